@@ -0,0 +1,117 @@
+#ifndef ADAPTIVEBINNING_H
+#define ADAPTIVEBINNING_H
+
+#include<vector>
+
+// ROOT
+#include<TAxis.h>
+
+// user incuded files
+#include "ResponseCube.h"
+
+// If > 0, the z-bins of each E_gen, eta_gen bin are merged to bins with at least this many fastsim and fullsim entries
+int ADAPTIVEENTRIES = 0;
+// If > 0, neighbouring eta_gen bins are merged until they have at least this many fastsim and fullsim entries
+int MERGEETAENTRIES = 0;
+
+struct EtaGroup {
+    // The eta_gen bins firstY to lastY of the E_gen bin x share one scale
+    int x, firstY, lastY;
+};
+
+std::vector<EtaGroup> getEtaGroups( const ResponseCube& fast, const ResponseCube& full, int minEntries ) {
+    /* Groups consecutive eta_gen bins of each E_gen bin, until fastsim and fullsim have at least
+     * minEntries entries. A remainder with less entries is added to the previous group.
+     * With minEntries <= 0, each eta_gen bin is a group.
+     */
+    std::vector<EtaGroup> groups;
+    for( int x=1; x<fast.getNbinsX()+1; ++x ) {
+        double sumFast = 0, sumFull = 0;
+        int firstY = 1;
+        int nGroups = 0;
+        for( int y=1; y<fast.getNbinsY()+1; ++y ) {
+            sumFast += fast.column( x, y ).entries();
+            sumFull += full.column( x, y ).entries();
+            bool enough = sumFast >= minEntries && sumFull >= minEntries;
+            if( !enough && y < fast.getNbinsY() ) continue;
+            if( !enough && nGroups ) {
+                groups.back().lastY = y;
+            } else {
+                groups.push_back( EtaGroup{ x, firstY, y } );
+                nGroups++;
+            }
+            firstY = y+1;
+            sumFast = sumFull = 0;
+        }
+    }
+    return groups;
+}
+
+std::vector<float> sumColumns( const ResponseCube& cube, const EtaGroup& group ) {
+    // Distribution of all eta_gen bins of the group, including under- and overflow
+    std::vector<float> sum( cube.getNbinsZ()+2, 0 );
+    for( int y=group.firstY; y<=group.lastY; ++y ) {
+        auto column = cube.column( group.x, y );
+        for( int bin=column.first; bin<column.last(); ++bin ) sum[bin] += column[bin];
+    }
+    return sum;
+}
+
+class AdaptiveColumns {
+    /* Fastsim and fullsim distribution of one E_gen, eta_gen bin with merged z-bins.
+     * Neighbouring z-bins are merged from low to high until fastsim and fullsim have at least
+     * minEntries entries, so each bin has about the same population. A remainder with less entries
+     * is added to the previous bin. Under- and overflow are kept, the axis has variable bin edges.
+     */
+  public:
+    AdaptiveColumns( const ZColumn& fast, const ZColumn& full, const TAxis& axis, int minEntries ) {
+        int nZ = fast.size;
+        firstBins_.push_back( 0 );
+        fast_.push_back( fast[0] );
+        full_.push_back( full[0] );
+        std::vector<double> edges( 1, axis.GetBinLowEdge(1) );
+
+        double sumFast = 0, sumFull = 0;
+        int first = 1;
+        for( int bin=1; bin<nZ-1; ++bin ) {
+            sumFast += fast[bin];
+            sumFull += full[bin];
+            bool enough = sumFast >= minEntries && sumFull >= minEntries;
+            if( !enough && bin < nZ-2 ) continue;
+            if( !enough && fast_.size() > 1 ) {
+                fast_.back() += sumFast;
+                full_.back() += sumFull;
+                edges.back() = axis.GetBinUpEdge( bin );
+            } else {
+                firstBins_.push_back( first );
+                fast_.push_back( sumFast );
+                full_.push_back( sumFull );
+                edges.push_back( axis.GetBinUpEdge( bin ) );
+            }
+            first = bin+1;
+            sumFast = sumFull = 0;
+        }
+
+        firstBins_.push_back( nZ-1 );
+        fast_.push_back( fast[nZ-1] );
+        full_.push_back( full[nZ-1] );
+        firstBins_.push_back( nZ );
+
+        axis_ = TAxis( edges.size()-1, edges.data() );
+        axis_.SetTitle( axis.GetTitle() );
+    }
+
+    ZColumn fast() const { return ZColumn( fast_.data(), fast_.size() ); }
+    ZColumn full() const { return ZColumn( full_.data(), full_.size() ); }
+    const TAxis& axis() const { return axis_; }
+
+    // The merged bin i contains the original bins firstBins[i] to firstBins[i+1]-1
+    const std::vector<int>& getFirstBins() const { return firstBins_; }
+
+  private:
+    std::vector<float> fast_, full_;
+    std::vector<int> firstBins_;
+    TAxis axis_;
+};
+
+#endif
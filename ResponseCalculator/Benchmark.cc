@@ -0,0 +1,526 @@
+#include<algorithm>
+#include<chrono>
+#include<cmath>
+#include<cstdio>
+#include<fstream>
+#include<iostream>
+#include<string>
+#include<vector>
+#include<dirent.h>
+#include<unistd.h> // provides getopt
+
+// ROOT
+#include<TChain.h>
+#include<TFile.h>
+#include<TH1D.h>
+#include<TH3F.h>
+#include<TRandom3.h>
+#include<TROOT.h>
+#include<TTree.h>
+
+// user incuded files
+#include "ChebyshevScale.h"
+#include "ResponseCube.h"
+#include "ResultCache.h"
+#include "ScaleAlgorithms.h"
+#include "ScaleCalculation.h"
+#include "UnbinnedScale.h"
+
+using namespace std;
+
+// Shape of the synthetic response distributions
+double SIGMA = 0.01; // width of the Gaussian core
+double TAILFRACTION = 0.1; // fraction of events in the low tail
+
+// The results are written to this file if it is given, otherwise to stdout
+std::ofstream RESULTFILE;
+std::ostream& results() { return RESULTFILE.is_open() ? RESULTFILE : std::cout; }
+
+// Cubes with more bins are skipped, since they do not fit in memory
+const double MAXBINS = 2e8;
+
+template <class FUNC>
+double timeIt( FUNC func ) {
+    // Returns the wall time of func in milliseconds
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>( stop - start ).count();
+}
+
+int findFirstBinAboveLinear( const std::vector<int>& cumulative, int entries ) {
+    // Reference implementation: the linear search getScaleWithUncertainties used before
+    int bin = -1;
+    for( int i=cumulative.size()-1; 0<=i; --i ) {
+        if( cumulative.at(i) >= entries ) bin = i;
+    }
+    return bin;
+}
+
+int findLastBinBelowLinear( const std::vector<int>& cumulative, int entries ) {
+    // Reference implementation: the linear search getScaleWithUncertainties used before
+    int bin = -1;
+    for( int i=0; i<int(cumulative.size())-1; ++i ) {
+        if( cumulative.at(i) <= entries ) bin = i;
+    }
+    return bin;
+}
+
+double getSyntheticResponse( TRandom3& rand, double mean, double sigma ) {
+    // Gaussian response with a low tail, similar to E_sim/E_gen
+    double r = rand.Gaus( mean, sigma );
+    if( rand.Uniform() < TAILFRACTION ) r -= rand.Exp( 5*sigma );
+    return r;
+}
+
+TH1D getSyntheticResponse( const std::string& name, int nBins, int nEntries, double mean, double sigma, unsigned seed ) {
+    TH1D h( name.c_str(), ";E_{sim}/E_{gen};Entries", nBins, 0, 1.05 );
+    h.SetDirectory( 0 );
+    TRandom3 rand( seed );
+    for( int i=0; i<nEntries; i++ ) {
+        h.Fill( getSyntheticResponse( rand, mean, sigma ) );
+    }
+    return h;
+}
+
+TH3F getSyntheticCube( const std::string& name, int nBinsX, int nBinsY, int nBinsZ, int nEntries, double mean, unsigned seed ) {
+    // nEntries synthetic responses in each E_gen, eta_gen bin. The resolution improves with E_gen.
+    TH3F h3( name.c_str(), ";E_{gen};#eta_{gen};E/E_{gen}", nBinsX, 5, 1005, nBinsY, 0, 3.2, nBinsZ, 0, 1.05 );
+    h3.SetDirectory( 0 );
+    TRandom3 rand( seed );
+    for( int xbin=1; xbin<nBinsX+1; ++xbin ) {
+        double e = h3.GetXaxis()->GetBinCenter( xbin );
+        double sigma = SIGMA*( 1+10/sqrt( e ) );
+        for( int ybin=1; ybin<nBinsY+1; ++ybin ) {
+            double eta = h3.GetYaxis()->GetBinCenter( ybin );
+            for( int i=0; i<nEntries; i++ ) {
+                h3.Fill( e, eta, getSyntheticResponse( rand, mean, sigma ) );
+            }
+        }
+    }
+    return h3;
+}
+
+void writeSyntheticTree( const std::string& filename, int nBinsX, int nBinsY, int nEntries, double mean, unsigned seed ) {
+    // Same distributions as getSyntheticCube, but as responseTree with e, eta and r of each event
+    TFile file( filename.c_str(), "recreate" );
+    TTree tree( "responseTree", "" );
+    float e, eta, r;
+    tree.Branch( "e", &e, "e/F" );
+    tree.Branch( "eta", &eta, "eta/F" );
+    tree.Branch( "r", &r, "r/F" );
+    TRandom3 rand( seed );
+    long long nEvents = (long long)nBinsX*nBinsY*nEntries;
+    for( long long i=0; i<nEvents; i++ ) {
+        e = rand.Uniform( 5, 1005 );
+        eta = rand.Uniform( 0, 3.2 );
+        r = getSyntheticResponse( rand, mean, SIGMA*( 1+10/sqrt( e ) ) );
+        tree.Fill();
+    }
+    tree.Write();
+    file.Close();
+}
+
+bool benchmarkQuantileMatching( int nBins, int nEntries ) {
+    auto h1_full = getSyntheticResponse( "full", nBins, nEntries, 0.98, 0.01, 1 );
+
+    std::vector<int> cumulative;
+    cumulative.push_back( int(h1_full.GetBinContent(0)) );
+    for( int i=1; i<nBins+2; ++i ) {
+        cumulative.push_back( cumulative.back() + int(h1_full.GetBinContent(i)) );
+    }
+
+    // Search for all possible targets, including some outside the range
+    std::vector<int> targets;
+    for( int entries=-1; entries<=nEntries+1; entries += std::max( 1, nEntries/(2*nBins) ) ) {
+        targets.push_back( entries );
+    }
+
+    std::vector<int> linear( 2*targets.size() ), binary( 2*targets.size() );
+    double tLinear = timeIt( [&]() {
+        for( unsigned i=0; i<targets.size(); i++ ) {
+            linear[2*i]   = findFirstBinAboveLinear( cumulative, targets[i] );
+            linear[2*i+1] = findLastBinBelowLinear ( cumulative, targets[i] );
+        }
+    } );
+    double tBinary = timeIt( [&]() {
+        for( unsigned i=0; i<targets.size(); i++ ) {
+            binary[2*i]   = findFirstBinAbove( cumulative, targets[i] );
+            binary[2*i+1] = findLastBinBelow ( cumulative, targets[i] );
+        }
+    } );
+
+    bool identical = linear == binary;
+    results() << "quantileMatching," << nBins << "," << targets.size() << ","
+        << tLinear << "," << tBinary << "," << tLinear/tBinary << ","
+        << ( identical ? "identical" : "DIFFERENT" ) << std::endl;
+    return identical;
+}
+
+bool benchmarkClopperPearson( int nBins, int nCells ) {
+    // Cells with similar statistics share most (total, passed) pairs
+    auto h1 = getSyntheticResponse( "fast", nBins, 100000, 0.985, 0.01, 4 );
+    int total = h1.GetEntries();
+    std::vector<int> cumulative;
+    int summed = 0;
+    for( int i=1; i<nBins+2; ++i ) {
+        summed += h1.GetBinContent(i);
+        cumulative.push_back( summed );
+    }
+    double level = TMath::Erf( 1./TMath::Sqrt2() );
+
+    std::vector<double> directDn( cumulative.size() ), directUp( cumulative.size() );
+    double tDirect = timeIt( [&]() {
+        for( int cell=0; cell<nCells; cell++ ) {
+            for( unsigned i=0; i<cumulative.size(); ++i ) {
+                directDn[i] = TEfficiency::ClopperPearson( total, cumulative[i], level, false );
+                directUp[i] = TEfficiency::ClopperPearson( total, cumulative[i], level, true );
+            }
+        }
+    } );
+
+    ClopperPearsonCache cache( level );
+    std::vector<double> cachedDn, cachedUp;
+    double tCached = timeIt( [&]() {
+        for( int cell=0; cell<nCells; cell++ ) {
+            cache.intervals( total, cumulative, cachedDn, cachedUp );
+        }
+    } );
+
+    bool identical = directDn == cachedDn && directUp == cachedUp;
+    results() << "clopperPearson," << nBins << "," << nCells << ","
+        << tDirect << "," << tCached << "," << tDirect/tCached << ","
+        << ( identical ? "identical" : "DIFFERENT" ) << std::endl;
+    return identical;
+}
+
+bool benchmarkSimplifiedScale( int nBinsX, int nBinsY, int nBinsZ, int nEntries, unsigned nThreads ) {
+    auto h3_fast = getSyntheticCube( "fast", nBinsX, nBinsY, nBinsZ, nEntries, 0.985, 9 );
+    auto h3_full = getSyntheticCube( "full", nBinsX, nBinsY, nBinsZ, nEntries, 0.98, 10 );
+    ResponseCube fast( h3_fast );
+    ResponseCube full( h3_full );
+    const TAxis& axis = *h3_fast.GetZaxis();
+
+    // Reference implementation: getSimplifiedScale of the projection of each E_gen, eta_gen bin
+    auto reference = *((TH3F*)h3_fast.Clone( "reference" ));
+    reference.Reset();
+    double tReference = timeIt( [&]() {
+        for( int xbin=1; xbin<nBinsX+1; ++xbin ) {
+            for( int ybin=1; ybin<nBinsY+1; ++ybin ) {
+                auto h1_scale = getSimplifiedScale( columnToHist( fast.column( xbin, ybin ), axis, "fast" ),
+                    columnToHist( full.column( xbin, ybin ), axis, "full" ) );
+                for( int i=1; i<nBinsZ+2; i++ ) {
+                    reference.SetBinContent( xbin, ybin, i, h1_scale.GetBinContent(i) );
+                }
+            }
+        }
+    } );
+
+    auto h3_scale = *((TH3F*)h3_fast.Clone( "scale" ));
+    h3_scale.Reset();
+    TH3F cube;
+    double tCube = timeIt( [&]() { cube = getSimplifiedScale( fast, full, h3_scale, nThreads ); } );
+
+    bool identical = true;
+    for( int xbin=1; xbin<nBinsX+1; ++xbin ) {
+        for( int ybin=1; ybin<nBinsY+1; ++ybin ) {
+            for( int i=1; i<nBinsZ+2; i++ ) {
+                identical &= cube.GetBinContent( xbin, ybin, i ) == reference.GetBinContent( xbin, ybin, i );
+            }
+        }
+    }
+    results() << "simplifiedScale," << nBinsZ << "," << nBinsX*nBinsY << ","
+        << tReference << "," << tCube << "," << tReference/tCube << ","
+        << ( identical ? "identical" : "DIFFERENT" ) << std::endl;
+    return identical;
+}
+
+void benchmarkBinned( int nBinsX, int nBinsY, int nBinsZ, int nEntries, unsigned nThreads ) {
+    auto h3_fast = getSyntheticCube( "fast", nBinsX, nBinsY, nBinsZ, nEntries, 0.985, 5 );
+    auto h3_full = getSyntheticCube( "full", nBinsX, nBinsY, nBinsZ, nEntries, 0.98, 6 );
+    double t = timeIt( [&]() { calculateResponse( h3_fast, h3_full, nThreads ); } );
+    results() << "calculateResponse," << nBinsZ << "," << nBinsX*nBinsY << ","
+        << 2LL*nBinsX*nBinsY*nEntries << "," << nThreads << "," << t << std::endl;
+    t = timeIt( [&]() { getSimplifiedScale( h3_fast, h3_full, nThreads ); } );
+    results() << "getSimplifiedScaleCube," << nBinsZ << "," << nBinsX*nBinsY << ","
+        << 2LL*nBinsX*nBinsY*nEntries << "," << nThreads << "," << t << std::endl;
+}
+
+bool benchmarkBootstrap( int nBinsX, int nBinsY, int nBinsZ, int nEntries, int nReplicas, unsigned nThreads ) {
+    // The bootstrap uncertainties have to be the same for any number of threads
+    auto h3_fast = getSyntheticCube( "fast", nBinsX, nBinsY, nBinsZ, nEntries, 0.985, 11 );
+    auto h3_full = getSyntheticCube( "full", nBinsX, nBinsY, nBinsZ, nEntries, 0.98, 12 );
+    int replicas = BOOTSTRAPREPLICAS;
+    BOOTSTRAPREPLICAS = nReplicas;
+    TH3F serialDn, serialUp, parallelDn, parallelUp;
+    double tSerial = timeIt( [&]() { calculateResponse( h3_fast, h3_full, 1, &serialDn, &serialUp ); } );
+    double tParallel = timeIt( [&]() { calculateResponse( h3_fast, h3_full, nThreads, &parallelDn, &parallelUp ); } );
+    BOOTSTRAPREPLICAS = replicas;
+
+    bool identical = true;
+    for( int xbin=1; xbin<nBinsX+1; ++xbin ) {
+        for( int ybin=1; ybin<nBinsY+1; ++ybin ) {
+            for( int i=1; i<nBinsZ+2; i++ ) {
+                identical &= serialDn.GetBinContent( xbin, ybin, i ) == parallelDn.GetBinContent( xbin, ybin, i );
+                identical &= serialUp.GetBinContent( xbin, ybin, i ) == parallelUp.GetBinContent( xbin, ybin, i );
+            }
+        }
+    }
+    results() << "bootstrap," << nBinsZ << "," << nBinsX*nBinsY << "," << nReplicas << ","
+        << tSerial << "," << tParallel << "," << nThreads << ","
+        << ( identical ? "identical" : "DIFFERENT" ) << std::endl;
+    return identical;
+}
+
+bool benchmarkAdaptiveClosure( int nBinsZ, int nEntries, int minEntries, unsigned nThreads ) {
+    /* Fullsim is shifted by a known amount with respect to fastsim. The fastsim distribution scaled by the
+     * adaptively binned scale has to reproduce the mean of the fullsim distribution in each E_gen, eta_gen bin.
+     * With minEntries = 0, the scale is calculated in the original z-bins.
+     */
+    auto h3_fast = getSyntheticCube( "fast", 2, 4, nBinsZ, nEntries, 0.985, 19 );
+    auto h3_full = getSyntheticCube( "full", 2, 4, nBinsZ, nEntries, 0.98, 20 );
+    int adaptive = ADAPTIVEENTRIES;
+    ADAPTIVEENTRIES = minEntries;
+    TH3F h3_scale;
+    double t = timeIt( [&]() { h3_scale = calculateResponse( h3_fast, h3_full, nThreads ); } );
+    ADAPTIVEENTRIES = adaptive;
+
+    double maxDeviation = 0;
+    for( int xbin=1; xbin<3; ++xbin ) {
+        for( int ybin=1; ybin<5; ++ybin ) {
+            double sumFast = 0, sumScaled = 0, sumFull = 0, sumFullR = 0;
+            for( int zbin=1; zbin<nBinsZ+1; ++zbin ) {
+                double r = h3_fast.GetZaxis()->GetBinCenter( zbin );
+                sumFast += h3_fast.GetBinContent( xbin, ybin, zbin );
+                sumScaled += h3_fast.GetBinContent( xbin, ybin, zbin ) * r * h3_scale.GetBinContent( xbin, ybin, zbin );
+                sumFull += h3_full.GetBinContent( xbin, ybin, zbin );
+                sumFullR += h3_full.GetBinContent( xbin, ybin, zbin ) * r;
+            }
+            maxDeviation = std::max( maxDeviation, std::abs( sumScaled/sumFast - sumFullR/sumFull ) );
+        }
+    }
+    // The shift is 0.005, the closure has to be better than the width of a few bins
+    bool closes = maxDeviation < 0.001;
+    results() << "adaptiveClosure," << nBinsZ << "," << minEntries << "," << t << "," << maxDeviation << ","
+        << ( closes ? "closes" : "NO CLOSURE" ) << std::endl;
+    return closes;
+}
+
+bool benchmarkResultCache( int nBinsX, int nBinsY, int nBinsZ, int nEntries, int nReplicas, unsigned nThreads ) {
+    /* Calculation with an empty result cache, again without changes, and after adding events to one
+     * E_gen, eta_gen bin. The last one has to be the same as a calculation without cache.
+     */
+    auto h3_fast = getSyntheticCube( "fast", nBinsX, nBinsY, nBinsZ, nEntries, 0.985, 16 );
+    auto h3_full = getSyntheticCube( "full", nBinsX, nBinsY, nBinsZ, nEntries, 0.98, 17 );
+    int replicas = BOOTSTRAPREPLICAS;
+    BOOTSTRAPREPLICAS = nReplicas;
+    char directory[] = "/tmp/resultCacheXXXXXX";
+    if( !mkdtemp( directory ) ) {
+        std::cerr << "ERROR: Could not create a directory in /tmp" << std::endl;
+        exit(1);
+    }
+    RESULTCACHEDIR = directory;
+
+    TH3F errorDn, errorUp, referenceDn, referenceUp;
+    double tCold = timeIt( [&]() { calculateResponse( h3_fast, h3_full, nThreads, &errorDn, &errorUp ); } );
+    double tWarm = timeIt( [&]() { calculateResponse( h3_fast, h3_full, nThreads, &errorDn, &errorUp ); } );
+    TRandom3 rand( 18 );
+    for( int i=0; i<nEntries/10; ++i ) h3_full.Fill( 500, 1.6, getSyntheticResponse( rand, 0.98, SIGMA ) );
+    TH3F h3_scale;
+    double tChanged = timeIt( [&]() { h3_scale = calculateResponse( h3_fast, h3_full, nThreads, &errorDn, &errorUp ); } );
+
+    RESULTCACHEDIR = "";
+    auto reference = calculateResponse( h3_fast, h3_full, nThreads, &referenceDn, &referenceUp );
+    BOOTSTRAPREPLICAS = replicas;
+    DIR* dir = opendir( directory );
+    while( dirent* entry = readdir( dir ) ) {
+        if( entry->d_name[0] != '.' ) std::remove( ( std::string( directory ) + "/" + entry->d_name ).c_str() );
+    }
+    closedir( dir );
+    rmdir( directory );
+
+    bool identical = true;
+    for( int xbin=1; xbin<nBinsX+1; ++xbin ) {
+        for( int ybin=1; ybin<nBinsY+1; ++ybin ) {
+            for( int i=1; i<nBinsZ+2; i++ ) {
+                identical &= h3_scale.GetBinContent( xbin, ybin, i ) == reference.GetBinContent( xbin, ybin, i );
+                identical &= errorDn.GetBinContent( xbin, ybin, i ) == referenceDn.GetBinContent( xbin, ybin, i );
+                identical &= errorUp.GetBinContent( xbin, ybin, i ) == referenceUp.GetBinContent( xbin, ybin, i );
+            }
+        }
+    }
+    results() << "resultCache," << nBinsZ << "," << nBinsX*nBinsY << "," << nReplicas << ","
+        << tCold << "," << tWarm << "," << tChanged << "," << tCold/tChanged << ","
+        << ( identical ? "identical" : "DIFFERENT" ) << std::endl;
+    return identical;
+}
+
+void benchmarkChebyshev( int nBinsX, int nBinsY, int nBinsZ, int nEntries, unsigned nThreads ) {
+    // Lookup of the binned scale and of its Chebyshev series for random events
+    auto h3_fast = getSyntheticCube( "fast", nBinsX, nBinsY, nBinsZ, nEntries, 0.985, 13 );
+    auto h3_full = getSyntheticCube( "full", nBinsX, nBinsY, nBinsZ, nEntries, 0.98, 14 );
+    auto h3_scale = calculateResponse( h3_fast, h3_full, nThreads );
+    ScaleMap table( h3_scale );
+    ChebyshevScale chebyshev( h3_scale, 1e-3, nThreads );
+
+    const size_t nEvents = 1000000;
+    std::vector<float> e( nEvents ), eta( nEvents ), r( nEvents ), tableScales( nEvents ), chebyshevScales( nEvents );
+    TRandom3 rand( 15 );
+    for( size_t i=0; i<nEvents; i++ ) {
+        e[i] = rand.Uniform( 5, 1005 );
+        eta[i] = rand.Uniform( 0, 3.2 );
+        r[i] = getSyntheticResponse( rand, 0.985, SIGMA );
+    }
+    double tTable = timeIt( [&]() { table.getScales( e.data(), eta.data(), r.data(), nEvents, tableScales.data() ); } );
+    double tChebyshev = timeIt( [&]() { chebyshev.getScales( e.data(), eta.data(), r.data(), nEvents, chebyshevScales.data() ); } );
+
+    results() << "chebyshevScale," << nBinsZ << "," << nBinsX*nBinsY << "," << chebyshev.getNCoefficients() << ","
+        << tTable << "," << tChebyshev << "," << tTable/tChebyshev << "," << chebyshev.getMaxDeviation() << std::endl;
+}
+
+bool benchmarkUnbinned( TChain& fasttree, TChain& fulltree, int nBinsX, int nBinsY, int nBinsZ, unsigned nThreads ) {
+    TH3F h3( "scale", ";E_{gen};#eta_{gen};E/E_{gen}", nBinsX, 5, 1005, nBinsY, 0, 3.2, nBinsZ, 0.8, 1.01 );
+    h3.SetDirectory( 0 );
+    long long nEvents = fasttree.GetEntries() + fulltree.GetEntries();
+    std::string prefix = std::to_string( nBinsZ ) + "," + std::to_string( nBinsX*nBinsY ) + ",";
+
+    TH3F scales3d;
+    double t = timeIt( [&]() { scales3d = calculateResponseUnbinned( fasttree, fulltree, h3, nThreads ); } );
+    results() << "calculateResponseUnbinned," << prefix << nEvents << "," << nThreads << "," << t << std::endl;
+
+    int compression = SKETCHCOMPRESSION;
+    SKETCHCOMPRESSION = 100;
+    t = timeIt( [&]() { calculateResponseUnbinned( fasttree, fulltree, h3, nThreads ); } );
+    results() << "calculateResponseSketch," << prefix << nEvents << "," << nThreads << "," << t << std::endl;
+    SKETCHCOMPRESSION = compression;
+
+    // The external sort with a small memory budget has to give the same scale as the in-memory sort
+    size_t budget = MEMORYBUDGET;
+    MEMORYBUDGET = 1;
+    TH3F external;
+    t = timeIt( [&]() { external = calculateResponseUnbinned( fasttree, fulltree, h3, nThreads ); } );
+    results() << "calculateResponseExternal," << prefix << nEvents << "," << nThreads << "," << t << std::endl;
+    MEMORYBUDGET = budget;
+    bool identical = true;
+    for( int xbin=0; xbin<nBinsX+2; ++xbin ) {
+        for( int ybin=0; ybin<nBinsY+2; ++ybin ) {
+            for( int zbin=0; zbin<nBinsZ+2; ++zbin ) {
+                identical &= external.GetBinContent( xbin, ybin, zbin ) == scales3d.GetBinContent( xbin, ybin, zbin );
+                identical &= external.GetBinError( xbin, ybin, zbin ) == scales3d.GetBinError( xbin, ybin, zbin );
+            }
+        }
+    }
+    if( !identical ) std::cerr << "ERROR: The external sort gives a DIFFERENT scale for " << nBinsZ << " bins" << std::endl;
+
+    t = timeIt( [&]() { closure3d( fasttree, scales3d, false, nThreads ); } );
+    results() << "closure3d," << prefix << fasttree.GetEntries() << "," << nThreads << "," << t << std::endl;
+    return identical;
+}
+
+int main( int argc, char** argv ) {
+    /* Prints the results as csv. Each block starts with a header line, which starts with #.
+     * The micro benchmarks compare optimized kernels with their reference implementations,
+     * the macro benchmarks time the full scale calculation on synthetic E_gen, eta_gen grids.
+     * The timed functions print to stdout as well, so use -o to get only the results.
+     */
+    gROOT->SetBatch();
+
+    unsigned nThreads = 0; // all cores
+    int nEntries = 1000; // per E_gen, eta_gen bin
+    bool fullGrid = false; // the grid of 100 x 400 bins of the analysis
+    int opt;
+    while( ( opt = getopt( argc, argv, "j:n:w:t:lo:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'j': nThreads = std::stoi( optarg ); break;
+            case 'n': nEntries = std::stoi( optarg ); break;
+            case 'w': SIGMA = std::stod( optarg ); break;
+            case 't': TAILFRACTION = std::stod( optarg ); break;
+            case 'l': fullGrid = true; break;
+            case 'o': RESULTFILE.open( optarg ); break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-j nThreads] [-n entriesPerBin] [-w sigma] [-t tailFraction] [-l] [-o results.csv]" << std::endl;
+                return 1;
+        }
+    }
+    nThreads = getNumberOfThreads( nThreads );
+
+    bool ok = true;
+
+    results() << "# kernel,nBins,nSearches,linear_ms,binary_ms,speedup,check" << std::endl;
+    for( int nBins : { 100, 1000, 2000, 20000 } ) {
+        ok &= benchmarkQuantileMatching( nBins, 100000 );
+    }
+
+    results() << "# kernel,nBins,nCells,direct_ms,cached_ms,speedup,check" << std::endl;
+    for( int nBins : { 100, 1000, 2000, 20000 } ) {
+        ok &= benchmarkClopperPearson( nBins, 100 );
+    }
+
+    // The reference integrates again for each pair of bins, so only small histograms are compared
+    results() << "# kernel,nBinsZ,nCells,perBin_ms,cube_ms,speedup,check" << std::endl;
+    for( int nBinsZ : { 100, 200 } ) {
+        ok &= benchmarkSimplifiedScale( 10, 40, nBinsZ, nEntries, nThreads );
+    }
+
+    results() << "# function,nBins,ms" << std::endl;
+    for( int nBins : { 100, 1000, 2000, 20000 } ) {
+        auto h1_fast = getSyntheticResponse( "fast", nBins, 100000, 0.985, SIGMA, 2 );
+        auto h1_full = getSyntheticResponse( "full", nBins, 100000, 0.98, SIGMA, 3 );
+        TGraphAsymmErrors scale;
+        double t = timeIt( [&]() { scale = getScaleWithUncertainties( h1_fast, h1_full ); } );
+        results() << "getScaleWithUncertainties," << nBins << "," << t << std::endl;
+        t = timeIt( [&]() { modifyScale( scale, h1_full.GetMean()/h1_fast.GetMean() ); } );
+        results() << "modifyScale," << nBins << "," << t << std::endl;
+        t = timeIt( [&]() { getSimplifiedScale( h1_fast, h1_full ); } );
+        results() << "getSimplifiedScale," << nBins << "," << t << std::endl;
+    }
+
+    results() << "# function,nBinsZ,nCells,nReplicas,serial_ms,parallel_ms,nThreads,check" << std::endl;
+    for( int nBinsZ : { 100, 1000 } ) {
+        ok &= benchmarkBootstrap( 10, 40, nBinsZ, nEntries, 1000, nThreads );
+    }
+
+    results() << "# function,nBinsZ,minEntries,ms,maxDeviation,check" << std::endl;
+    for( int minEntries : { 0, 100, 1000 } ) {
+        ok &= benchmarkAdaptiveClosure( 2000, 100000, minEntries, nThreads );
+    }
+
+    results() << "# function,nBinsZ,nCells,nReplicas,cold_ms,warm_ms,oneChanged_ms,speedup,check" << std::endl;
+    for( int nBinsZ : { 100, 1000 } ) {
+        ok &= benchmarkResultCache( 10, 40, nBinsZ, nEntries, 100, nThreads );
+    }
+
+    results() << "# kernel,nBinsZ,nCells,nCoefficients,table_ms,chebyshev_ms,speedup,maxDeviation" << std::endl;
+    for( int nBinsZ : { 100, 1000, 2000 } ) {
+        benchmarkChebyshev( 10, 40, nBinsZ, nEntries, nThreads );
+    }
+
+    std::vector<std::pair<int,int>> grids = { { 10, 40 } };
+    if( fullGrid ) grids.push_back( { 100, 400 } );
+
+    results() << "# function,nBinsZ,nCells,nEvents,nThreads,ms" << std::endl;
+    for( auto& grid : grids ) {
+        for( int nBinsZ : { 100, 1000, 2000, 20000 } ) {
+            if( double( grid.first+2 )*( grid.second+2 )*( nBinsZ+2 ) > MAXBINS ) {
+                results() << "# skipped calculateResponse," << nBinsZ << "," << grid.first*grid.second << std::endl;
+                continue;
+            }
+            benchmarkBinned( grid.first, grid.second, nBinsZ, nEntries, nThreads );
+        }
+
+        std::string fastname = "benchmark_fast.root", fullname = "benchmark_full.root";
+        writeSyntheticTree( fastname, grid.first, grid.second, nEntries, 0.985, 7 );
+        writeSyntheticTree( fullname, grid.first, grid.second, nEntries, 0.98, 8 );
+        TChain fasttree( "responseTree" );
+        fasttree.AddFile( fastname.c_str() );
+        TChain fulltree( "responseTree" );
+        fulltree.AddFile( fullname.c_str() );
+        for( int nBinsZ : { 100, 1000, 2000, 20000 } ) {
+            ok &= benchmarkUnbinned( fasttree, fulltree, grid.first, grid.second, nBinsZ, nThreads );
+        }
+        std::remove( fastname.c_str() );
+        std::remove( fullname.c_str() );
+    }
+
+    return ok ? 0 : 1;
+}
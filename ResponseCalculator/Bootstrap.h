@@ -0,0 +1,97 @@
+#ifndef BOOTSTRAP_H
+#define BOOTSTRAP_H
+
+#include<algorithm>
+#include<cmath>
+#include<cstdint>
+#include<vector>
+
+// ROOT
+#include<TAxis.h>
+#include<TGraphAsymmErrors.h>
+
+// user incuded files
+#include "CounterRandom.h"
+#include "Instrumentation.h"
+#include "ResponseCube.h"
+
+// If > 0, the uncertainties of the scale are estimated from this number of bootstrap replicas
+int BOOTSTRAPREPLICAS = 0;
+unsigned BOOTSTRAPSEED = 1;
+
+void getMatchedScale( const std::vector<int>& cumulativeFast, const std::vector<int>& cumulativeFull, const TAxis& axis, float* scale, int stride ) {
+    /* Central value of the quantile matching, without uncertainties: the fullsim bin, in which the
+     * fraction of fullsim events equals the fraction of fastsim events up to the fastsim bin.
+     * The cumulative distributions include the underflow bin. The scale of bin i is written to scale[i*stride].
+     */
+    int nBins = cumulativeFast.size();
+    double entriesFast = cumulativeFast.back();
+    double entriesFull = cumulativeFull.back();
+    int binFull = 0;
+    for( int binFast=1; binFast<nBins; ++binFast ) {
+        double entries = ( cumulativeFast[binFast]-cumulativeFast[0] )/entriesFast*entriesFull;
+        // The target grows with binFast, so the matching bin is searched from the previous one
+        while( binFull < nBins-1 && cumulativeFull[binFull] < entries ) ++binFull;
+        scale[binFast*stride] = axis.GetBinCenter( binFull )/axis.GetBinCenter( binFast );
+    }
+}
+
+void resample( const ZColumn& column, CounterRandom& rand, std::vector<int>& cumulative ) {
+    // Cumulative distribution of a Poisson bootstrap replica: each bin count is replaced by a Poisson number
+    // with this mean. Empty bins stay empty and do not use random numbers.
+    int sum = 0;
+    for( int bin=0; bin<column.size; ++bin ) {
+        if( column[bin] ) sum += rand.poisson( column[bin] );
+        cumulative[bin] = sum;
+    }
+}
+
+void setBootstrapUncertainties( TGraphAsymmErrors& scale, const ZColumn& fast, const ZColumn& full, const TAxis& axis, uint64_t cell ) {
+    /* Replaces the uncertainties of the scale by the central 68.3% interval of BOOTSTRAPREPLICAS replicas
+     * of the fastsim and fullsim distributions. The replicas use the plain quantile matching of
+     * getMatchedScale, since the Clopper-Pearson intervals of getScaleWithUncertainties would be needed
+     * for each replica. The interval is taken relative to the scale of the graph, so the uncertainties
+     * reach from the scale to the quantiles of the replicas.
+     * The random numbers of each cell and replica are independent of the thread and the other cells.
+     */
+    static auto bootstrapTimer = getTimer( "bootstrap" );
+    ScopedTimer timer( bootstrapTimer );
+
+    int nBins = fast.size;
+    int nReplicas = BOOTSTRAPREPLICAS;
+    std::vector<int> cumulativeFast( nBins ), cumulativeFull( nBins );
+
+    // The central value, the graph has a point for each bin except the underflow
+    std::vector<float> nominal( nBins, 0 );
+    for( int bin=1; bin<std::min( nBins, scale.GetN() ); ++bin ) nominal[bin] = scale.GetY()[bin];
+
+    // The replicas of each bin are contiguous, to find the quantiles
+    std::vector<float> replicas( size_t(nBins)*nReplicas );
+    for( int replica=0; replica<nReplicas; ++replica ) {
+        CounterRandom randFast( streamKey( BOOTSTRAPSEED, cell, replica, 0 ) );
+        CounterRandom randFull( streamKey( BOOTSTRAPSEED, cell, replica, 1 ) );
+        resample( fast, randFast, cumulativeFast );
+        resample( full, randFull, cumulativeFull );
+        // Replicas without fastsim or fullsim events keep the nominal scale
+        if( !cumulativeFast.back() || !cumulativeFull.back() ) {
+            for( int bin=1; bin<nBins; ++bin ) replicas[size_t(bin)*nReplicas+replica] = nominal[bin];
+            continue;
+        }
+        getMatchedScale( cumulativeFast, cumulativeFull, axis, &replicas[replica], nReplicas );
+    }
+
+    // Quantiles of the standard normal distribution at -1 and +1 sigma
+    int iDn = std::max( 0, int( 0.158655*nReplicas ) );
+    int iUp = std::min( nReplicas-1, int( 0.841345*nReplicas ) );
+    for( int bin=1; bin<nBins; ++bin ) {
+        auto first = replicas.begin() + size_t(bin)*nReplicas;
+        std::nth_element( first, first+iDn, first+nReplicas );
+        float dn = first[iDn];
+        std::nth_element( first+iDn, first+iUp, first+nReplicas );
+        float up = first[iUp];
+        scale.SetPointError( bin, 0, 0, std::max( 0.f, nominal[bin]-dn ), std::max( 0.f, up-nominal[bin] ) );
+    }
+    addCount( "bootstrapReplicas", nReplicas );
+}
+
+#endif
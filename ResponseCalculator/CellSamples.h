@@ -0,0 +1,96 @@
+#ifndef CELLSAMPLES_H
+#define CELLSAMPLES_H
+
+#include<algorithm>
+#include<cstdint>
+#include<cstring>
+#include<vector>
+
+// user incuded files
+#include "CellScheduler.h"
+
+uint32_t floatToSortable( float f ) {
+    // Maps the bits of a float to an unsigned integer with the same ordering
+    uint32_t u;
+    std::memcpy( &u, &f, sizeof(u) );
+    return u & 0x80000000u ? ~u : u | 0x80000000u;
+}
+
+float sortableToFloat( uint32_t u ) {
+    u = u & 0x80000000u ? u & 0x7fffffffu : ~u;
+    float f;
+    std::memcpy( &f, &u, sizeof(f) );
+    return f;
+}
+
+void radixSort( float* begin, float* end ) {
+    // LSD radix sort with 8 bit digits. Digits which are equal for all values are skipped,
+    // which is often the case for the exponent, since the response values are close to each other.
+    size_t n = end - begin;
+    if( n < 256 ) {
+        std::sort( begin, end );
+        return;
+    }
+    std::vector<uint32_t> keys( n ), buffer( n );
+    for( size_t i=0; i<n; ++i ) keys[i] = floatToSortable( begin[i] );
+
+    for( int shift=0; shift<32; shift+=8 ) {
+        size_t counts[256] = {};
+        for( auto key : keys ) counts[(key>>shift) & 0xff]++;
+        if( counts[(keys[0]>>shift) & 0xff] == n ) continue;
+        size_t offset = 0;
+        for( auto& count : counts ) {
+            size_t c = count;
+            count = offset;
+            offset += c;
+        }
+        for( auto key : keys ) buffer[counts[(key>>shift) & 0xff]++] = key;
+        keys.swap( buffer );
+    }
+
+    for( size_t i=0; i<n; ++i ) begin[i] = sortableToFloat( keys[i] );
+}
+
+struct CellSamples {
+    /* Values of all events, grouped by cell (e.g. the E_gen, eta_gen bin).
+     * The values of one cell are contiguous, and sorted after calling sort().
+     */
+    int nCells;
+    std::vector<size_t> offsets;
+    std::vector<float> values;
+
+    CellSamples( int n ) :
+        nCells( n ),
+        offsets( n+1, 0 )
+    {}
+
+    CellSamples( int n, const std::vector<std::vector<int>>& keys, const std::vector<std::vector<float>>& vals ) :
+        CellSamples( n )
+    {
+        // Counting sort by cell. keys and vals are given in chunks, which are concatenated in order.
+        for( auto& chunk : keys ) {
+            for( auto key : chunk ) offsets[key+1]++;
+        }
+        for( int cell=0; cell<nCells; ++cell ) offsets[cell+1] += offsets[cell];
+        values.resize( offsets[nCells] );
+        std::vector<size_t> position( offsets.begin(), offsets.end()-1 );
+        for( size_t chunk=0; chunk<keys.size(); ++chunk ) {
+            for( size_t i=0; i<keys[chunk].size(); ++i ) {
+                values[position[keys[chunk][i]]++] = vals[chunk][i];
+            }
+        }
+    }
+
+    size_t size( int cell ) const { return offsets[cell+1]-offsets[cell]; }
+    const float* begin( int cell ) const { return values.data()+offsets[cell]; }
+    const float* end( int cell ) const { return values.data()+offsets[cell+1]; }
+
+    void sort( unsigned nThreads=0 ) {
+        // Each cell is sorted independently, so the cells are sorted in parallel
+        runCells( nCells, nThreads, [&]( int cell ) {
+            radixSort( values.data()+offsets[cell], values.data()+offsets[cell+1] );
+        } );
+    }
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef CELLSCHEDULER_H
+#define CELLSCHEDULER_H
+
+#include<algorithm>
+#include<deque>
+#include<exception>
+#include<functional>
+#include<memory>
+#include<mutex>
+#include<thread>
+#include<vector>
+
+unsigned getNumberOfThreads( unsigned nThreads=0 ) {
+    // 0 means: use all cores of this machine
+    if( nThreads ) return nThreads;
+    unsigned nCores = std::thread::hardware_concurrency();
+    return nCores ? nCores : 1;
+}
+
+struct CellQueue {
+    std::mutex mutex;
+    std::deque<int> cells;
+};
+
+bool stealCells( CellQueue& thief, CellQueue& victim ) {
+    // Moves the back half of the victims queue to the thief.
+    // Only the thief takes from the front of its own queue, so locality is kept.
+    std::lock( thief.mutex, victim.mutex );
+    std::lock_guard<std::mutex> lockThief( thief.mutex, std::adopt_lock );
+    std::lock_guard<std::mutex> lockVictim( victim.mutex, std::adopt_lock );
+    if( victim.cells.empty() ) return false;
+    size_t nSteal = ( victim.cells.size() + 1 ) / 2;
+    thief.cells.insert( thief.cells.end(), victim.cells.end()-nSteal, victim.cells.end() );
+    victim.cells.erase( victim.cells.end()-nSteal, victim.cells.end() );
+    return true;
+}
+
+bool popCell( CellQueue& queue, int& cell ) {
+    std::lock_guard<std::mutex> lock( queue.mutex );
+    if( queue.cells.empty() ) return false;
+    cell = queue.cells.front();
+    queue.cells.pop_front();
+    return true;
+}
+
+void runCells( int nCells, unsigned nThreads, const std::function<void(int)>& processCell ) {
+    /* Calls processCell for each cell index in [0,nCells) on nThreads threads.
+     * Each thread starts with a contiguous block of cells. Threads which run out of work
+     * steal from the others, since the cost of a cell depends strongly on its statistics.
+     * processCell must only write into memory owned by its cell, the caller is responsible
+     * for merging the results in a deterministic order.
+     */
+    nThreads = std::min<unsigned>( getNumberOfThreads( nThreads ), std::max( nCells, 1 ) );
+
+    if( nThreads == 1 ) {
+        for( int cell=0; cell<nCells; ++cell ) processCell( cell );
+        return;
+    }
+
+    std::vector<std::unique_ptr<CellQueue>> queues;
+    for( unsigned t=0; t<nThreads; ++t ) {
+        queues.emplace_back( new CellQueue() );
+        int first = (long long)nCells*t/nThreads;
+        int last  = (long long)nCells*(t+1)/nThreads;
+        for( int cell=first; cell<last; ++cell ) {
+            queues.back()->cells.push_back( cell );
+        }
+    }
+
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    auto worker = [&]( unsigned t ) {
+        try {
+            int cell;
+            while( true ) {
+                while( popCell( *queues[t], cell ) ) processCell( cell );
+                // Own queue is empty, look for work at the other threads
+                bool stolen = false;
+                for( unsigned i=1; i<nThreads && !stolen; ++i ) {
+                    stolen = stealCells( *queues[t], *queues[(t+i)%nThreads] );
+                }
+                // No new cells are created, so if nothing could be stolen, all work is distributed
+                if( !stolen ) break;
+            }
+        } catch( ... ) {
+            std::lock_guard<std::mutex> lock( errorMutex );
+            if( !error ) error = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for( unsigned t=0; t<nThreads; ++t ) threads.emplace_back( worker, t );
+    for( auto& thread : threads ) thread.join();
+
+    if( error ) std::rethrow_exception( error );
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef CHEBYSHEVSCALE_H
+#define CHEBYSHEVSCALE_H
+
+#include<algorithm>
+#include<cmath>
+#include<cstdint>
+#include<cstdlib>
+#include<cstring>
+#include<fstream>
+#include<iostream>
+#include<string>
+#include<vector>
+
+// ROOT
+#include<TAxis.h>
+#include<TH3F.h>
+
+// user incuded files
+#include "CellScheduler.h"
+#include "Instrumentation.h"
+#include "ScaleMap.h"
+
+/* Binary format of the Chebyshev scale:
+ *   ChebyshevScaleHeader
+ *   ChebyshevCell cells[nCells]         for all E_gen, eta_gen bins including under- and overflow, eta_gen is the fastest running index
+ *   float coefficients[nCoefficients]
+ */
+
+const char CHEBYSHEVMAGIC[8] = { 'E', 'C', 'A', 'L', 'C', 'H', 'B', '\0' };
+const uint32_t CHEBYSHEVVERSION = 1;
+
+// If > 0, the scale is also stored as Chebyshev series, which deviate at most by this from the binned scale
+float CHEBYSHEVTOLERANCE = 0;
+// Cells, which can not be described within the tolerance, use this degree
+const int CHEBYSHEVMAXDEGREE = 16;
+
+struct ChebyshevScaleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t maxDegree;
+    // E_gen, eta_gen and E_sim/E_gen binning of the binned scale
+    ScaleMapAxis axes[3];
+    uint64_t nCells;
+    uint64_t nCoefficients;
+    float tolerance;
+    // Largest deviation from the binned scale of all cells
+    float maxDeviation;
+};
+static_assert( sizeof(ChebyshevScaleHeader) % 8 == 0, "The cells have to be aligned" );
+
+struct ChebyshevCell {
+    // The series is defined between the bin centers lo and hi, outside the value at the boundary is used
+    float lo, hi;
+    uint32_t first;
+    // Number of coefficients, 0 for bins without scale
+    uint32_t n;
+};
+
+double clenshaw( const float* coefficients, int n, double t ) {
+    // Evaluates sum_k c_k T_k(t)
+    double b1 = 0, b2 = 0;
+    for( int k=n-1; k>0; --k ) {
+        double b0 = coefficients[k] + 2*t*b1 - b2;
+        b2 = b1;
+        b1 = b0;
+    }
+    return n ? coefficients[0] + t*b1 - b2 : 0;
+}
+
+bool solveLinear( std::vector<double> a, std::vector<double> b, int n, int stride, std::vector<double>& x ) {
+    // Gaussian elimination with partial pivoting of the leading n x n system of a, with row length stride
+    for( int col=0; col<n; ++col ) {
+        int pivot = col;
+        for( int row=col+1; row<n; ++row ) {
+            if( std::abs( a[row*stride+col] ) > std::abs( a[pivot*stride+col] ) ) pivot = row;
+        }
+        if( !a[pivot*stride+col] ) return false;
+        for( int k=0; k<n; ++k ) std::swap( a[col*stride+k], a[pivot*stride+k] );
+        std::swap( b[col], b[pivot] );
+        for( int row=col+1; row<n; ++row ) {
+            double f = a[row*stride+col]/a[col*stride+col];
+            for( int k=col; k<n; ++k ) a[row*stride+k] -= f*a[col*stride+k];
+            b[row] -= f*b[col];
+        }
+    }
+    x.assign( n, 0 );
+    for( int row=n-1; row>=0; --row ) {
+        double sum = b[row];
+        for( int k=row+1; k<n; ++k ) sum -= a[row*stride+k]*x[k];
+        x[row] = sum/a[row*stride+row];
+    }
+    return true;
+}
+
+float fitChebyshev( const std::vector<double>& r, const std::vector<double>& values, float tolerance,
+        ChebyshevCell& cell, std::vector<float>& coefficients ) {
+    /* Least squares fit of the lowest degree, which deviates at most by tolerance from the values.
+     * The normal equations of all degrees are the leading blocks of the ones of the maximal degree,
+     * so they are summed only once. Returns the largest deviation.
+     */
+    int nPoints = r.size();
+    cell.lo = r.front();
+    cell.hi = r.back();
+    int nMax = std::min( CHEBYSHEVMAXDEGREE+1, nPoints );
+    std::vector<double> a( nMax*nMax, 0 ), b( nMax, 0 ), t( nPoints ), basis( nPoints*nMax );
+    for( int i=0; i<nPoints; ++i ) {
+        t[i] = cell.hi > cell.lo ? ( 2*r[i]-cell.lo-cell.hi )/( cell.hi-cell.lo ) : 0;
+        double* T = &basis[i*nMax];
+        T[0] = 1;
+        if( nMax > 1 ) T[1] = t[i];
+        for( int k=2; k<nMax; ++k ) T[k] = 2*t[i]*T[k-1] - T[k-2];
+        for( int j=0; j<nMax; ++j ) {
+            b[j] += T[j]*values[i];
+            for( int k=0; k<nMax; ++k ) a[j*nMax+k] += T[j]*T[k];
+        }
+    }
+
+    std::vector<double> x;
+    std::vector<float> best;
+    float bestDeviation = 0;
+    for( int n=1; n<=nMax; ++n ) {
+        if( !solveLinear( a, b, n, nMax, x ) ) break;
+        std::vector<float> c( x.begin(), x.end() );
+        float deviation = 0;
+        for( int i=0; i<nPoints; ++i ) {
+            deviation = std::max<float>( deviation, std::abs( clenshaw( c.data(), n, t[i] ) - values[i] ) );
+        }
+        if( best.empty() || deviation < bestDeviation ) {
+            best = c;
+            bestDeviation = deviation;
+        }
+        if( deviation <= tolerance ) break;
+    }
+    cell.first = coefficients.size();
+    cell.n = best.size();
+    coefficients.insert( coefficients.end(), best.begin(), best.end() );
+    return bestDeviation;
+}
+
+class ChebyshevScale {
+    /* Scale as function of E_gen, eta_gen and E_sim/E_gen, with a Chebyshev series in E_sim/E_gen
+     * for each E_gen, eta_gen bin instead of a table. Only a few coefficients per bin are needed,
+     * so the whole scale stays in the cache.
+     */
+  public:
+    ChebyshevScale( const TH3F& h3, float tolerance, unsigned nThreads=0 ) {
+        ScopedTimer timer( "fitChebyshev" );
+        std::memset( &header_, 0, sizeof(ChebyshevScaleHeader) );
+        std::memcpy( header_.magic, CHEBYSHEVMAGIC, sizeof(CHEBYSHEVMAGIC) );
+        header_.version = CHEBYSHEVVERSION;
+        header_.maxDegree = CHEBYSHEVMAXDEGREE;
+        header_.tolerance = tolerance;
+        const TAxis* axes[3] = { h3.GetXaxis(), h3.GetYaxis(), h3.GetZaxis() };
+        for( int i=0; i<3; ++i ) {
+            if( axes[i]->IsVariableBinSize() ) {
+                std::cerr << "ERROR: Chebyshev scales only support equidistant binning" << std::endl;
+                exit(1);
+            }
+            auto& axis = header_.axes[i];
+            axis.nBins = axes[i]->GetNbins();
+            axis.first = 0;
+            axis.last = axis.nBins+1;
+            axis.min = axes[i]->GetXmin();
+            axis.max = axes[i]->GetXmax();
+        }
+        int nX = header_.axes[0].nBins+2;
+        int nY = header_.axes[1].nBins+2;
+        header_.nCells = nX*nY;
+
+        // The cells are fitted in parallel, and their coefficients are concatenated in order
+        std::vector<ChebyshevCell> cells( header_.nCells );
+        std::vector<std::vector<float>> coefficients( header_.nCells );
+        std::vector<float> deviations( header_.nCells, 0 );
+        runCells( header_.nCells, nThreads, [&]( int cell ) {
+            std::vector<double> r, values;
+            for( int z=1; z<header_.axes[2].nBins+1; ++z ) {
+                double value = h3.GetBinContent( cell/nY, cell%nY, z );
+                if( !value ) continue;
+                r.push_back( axes[2]->GetBinCenter( z ) );
+                values.push_back( value );
+            }
+            std::memset( &cells[cell], 0, sizeof(ChebyshevCell) );
+            if( r.empty() ) return;
+            deviations[cell] = fitChebyshev( r, values, tolerance, cells[cell], coefficients[cell] );
+        } );
+
+        int nAboveTolerance = 0;
+        for( size_t cell=0; cell<cells.size(); ++cell ) {
+            cells[cell].first = coefficients_.size();
+            coefficients_.insert( coefficients_.end(), coefficients[cell].begin(), coefficients[cell].end() );
+            header_.maxDeviation = std::max( header_.maxDeviation, deviations[cell] );
+            nAboveTolerance += deviations[cell] > tolerance;
+        }
+        cells_ = cells;
+        header_.nCoefficients = coefficients_.size();
+        addCount( "chebyshevCoefficients", coefficients_.size() );
+        addCount( "chebyshevCellsAboveTolerance", nAboveTolerance );
+    }
+
+    ChebyshevScale( const std::string& filename ) {
+        std::ifstream file( filename.c_str(), std::ios::binary );
+        if( !file.read( (char*)&header_, sizeof(ChebyshevScaleHeader) ) ||
+                std::memcmp( header_.magic, CHEBYSHEVMAGIC, sizeof(CHEBYSHEVMAGIC) ) ||
+                header_.version != CHEBYSHEVVERSION ) {
+            std::cerr << "ERROR: " << filename << " is not a valid Chebyshev scale" << std::endl;
+            exit(1);
+        }
+        cells_.resize( header_.nCells );
+        coefficients_.resize( header_.nCoefficients );
+        if( !file.read( (char*)cells_.data(), cells_.size()*sizeof(ChebyshevCell) ) ||
+                !file.read( (char*)coefficients_.data(), coefficients_.size()*sizeof(float) ) ) {
+            std::cerr << "ERROR: Could not read Chebyshev scale " << filename << std::endl;
+            exit(1);
+        }
+    }
+
+    void write( const std::string& filename ) const {
+        std::ofstream file( filename.c_str(), std::ios::binary );
+        file.write( (const char*)&header_, sizeof(ChebyshevScaleHeader) );
+        file.write( (const char*)cells_.data(), cells_.size()*sizeof(ChebyshevCell) );
+        file.write( (const char*)coefficients_.data(), coefficients_.size()*sizeof(float) );
+        if( !file ) {
+            std::cerr << "ERROR: Could not write Chebyshev scale " << filename << std::endl;
+            exit(1);
+        }
+    }
+
+    float getScale( double e, double eta, double r ) const {
+        // Same as ScaleMap::getScale within the tolerance, except outside of the filled E_sim/E_gen range
+        const auto& cell = cells_[header_.axes[0].findBin( e )*( header_.axes[1].nBins+2 ) + header_.axes[1].findBin( eta )];
+        double t = cell.hi > cell.lo ? ( 2*r-cell.lo-cell.hi )/( cell.hi-cell.lo ) : 0;
+        t = std::min( 1., std::max( -1., t ) );
+        return clenshaw( coefficients_.data() + cell.first, cell.n, t );
+    }
+
+    void getScales( const float* e, const float* eta, const float* r, size_t n, float* scales ) const {
+        for( size_t i=0; i<n; ++i ) scales[i] = getScale( e[i], eta[i], r[i] );
+    }
+
+    float getMaxDeviation() const { return header_.maxDeviation; }
+    size_t getNCoefficients() const { return coefficients_.size(); }
+
+  private:
+    ChebyshevScaleHeader header_;
+    std::vector<ChebyshevCell> cells_;
+    std::vector<float> coefficients_;
+};
+
+void writeChebyshevScale( const TH3F& h3, const std::string& filename, float tolerance, unsigned nThreads=0 ) {
+    ChebyshevScale( h3, tolerance, nThreads ).write( filename );
+}
+
+#endif
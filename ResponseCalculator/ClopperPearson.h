@@ -0,0 +1,79 @@
+#ifndef CLOPPERPEARSON_H
+#define CLOPPERPEARSON_H
+
+#include<cstdint>
+#include<map>
+#include<unordered_map>
+#include<utility>
+#include<vector>
+
+// ROOT
+#include<TEfficiency.h>
+
+class ClopperPearsonCache {
+    /* Memoizes Clopper-Pearson intervals for one confidence level.
+     * Each interval needs the inverse of the incomplete beta function, which is expensive,
+     * while the same (total, passed) pairs appear in many bins with similar statistics.
+     * The intervals are computed by TEfficiency::ClopperPearson, so the results are identical.
+     */
+  public:
+    ClopperPearsonCache( double level, size_t maxSize=1<<22 ) :
+        level_( level ),
+        maxSize_( maxSize )
+    {}
+
+    double getLevel() const { return level_; }
+
+    std::pair<double,double> interval( int total, int passed ) {
+        // Returns the lower and upper boundary
+        uint64_t key = ( uint64_t(uint32_t(total)) << 32 ) | uint32_t(passed);
+        auto it = cache_.find( key );
+        if( it != cache_.end() ) return it->second;
+
+        // Do not let the memory grow without limits
+        if( cache_.size() >= maxSize_ ) cache_.clear();
+
+        auto result = std::make_pair(
+            TEfficiency::ClopperPearson( total, passed, level_, false ),
+            TEfficiency::ClopperPearson( total, passed, level_, true ) );
+        cache_.emplace( key, result );
+        return result;
+    }
+
+    double lower( int total, int passed ) { return interval( total, passed ).first; }
+    double upper( int total, int passed ) { return interval( total, passed ).second; }
+
+    void intervals( int total, const std::vector<int>& passed, std::vector<double>& lower, std::vector<double>& upper ) {
+        // Evaluates the intervals for a batch of passed values with the same total.
+        // Consecutive equal values (e.g. empty bins in a cumulative distribution) are computed once.
+        lower.resize( passed.size() );
+        upper.resize( passed.size() );
+        for( size_t i=0; i<passed.size(); ++i ) {
+            if( i && passed[i] == passed[i-1] ) {
+                lower[i] = lower[i-1];
+                upper[i] = upper[i-1];
+            } else {
+                auto result = interval( total, passed[i] );
+                lower[i] = result.first;
+                upper[i] = result.second;
+            }
+        }
+    }
+
+  private:
+    double level_;
+    size_t maxSize_;
+    std::unordered_map<uint64_t,std::pair<double,double>> cache_;
+};
+
+ClopperPearsonCache& getClopperPearsonCache( double level ) {
+    // One cache per thread and confidence level, so no locking is needed
+    thread_local std::map<double,ClopperPearsonCache> caches;
+    auto it = caches.find( level );
+    if( it == caches.end() ) {
+        it = caches.emplace( level, ClopperPearsonCache( level ) ).first;
+    }
+    return it->second;
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include<iomanip> // provides setprecision
 #include<iostream>
+#include<memory>
 #include<sstream>
 #include<string>
 
@@ -17,10 +18,23 @@
 #include<TVector3.h>
 
 // user incuded files
+#include "CellScheduler.h"
+#include "EventLoop.h"
+#include "Instrumentation.h"
+#include "PlotQueue.h"
+#include "ScaleAlgorithms.h"
+#include "ScaleCalculation.h"
+#include "ScaleMap.h"
+#include "Selection.h"
 #include "Style.h"
 
 using namespace std;
 
+// Only every PLOTSAMPLING-th E_gen, eta_gen bin is drawn, 0 disables the plots
+int PLOTSAMPLING = 1;
+// Maximal number of pages per pdf, 0 writes all pages into one file
+int PLOTSPERFILE = 0;
+
 TChain* getChain( std::string const & filename, std::string const & treename ) {
     TChain* ch = new TChain( treename.c_str() );
     ch->AddFile( filename.c_str() );
@@ -31,6 +45,7 @@ TChain* getChain( std::string const & filename, std::string const & treename ) {
 template <class HIST>
 HIST getHist( std::string const & filename, std::string const & histname ) {
     // Reads a histogram from a file
+    ScopedTimer timer( "readHist" );
 
     TFile file( filename.c_str() );
     if( file.IsZombie() ) {
@@ -52,165 +67,6 @@ HIST getHist( std::string const & filename, std::string const & histname ) {
     return hist;
 }
 
-TGraphAsymmErrors modifyScale( const TGraphAsymmErrors& origScale, double mean ) {
-    // Resplaces the points with too large uncertainty with the mean and removes all uncertainties.
-    // This is done to prevent statistical fluctuations.
-
-    auto modScale = (TGraphAsymmErrors*) origScale.Clone();
-
-    for( auto i=0; i<modScale->GetN(); i++) {
-        double x, y;
-        modScale->GetPoint(i, x, y );
-        double errorUp = modScale->GetErrorYhigh(i);
-        double errorDn = modScale->GetErrorYlow(i);
-        if(
-            (errorUp+errorDn)/2 > std::max( 0.05, std::abs( mean - 1 ) )// uncertainty larger than correction
-        ) {
-            modScale->SetPoint( i, x, mean );
-        }
-
-        // The uncertainties will not be used and are therefore set to 0
-        modScale->SetPointEYhigh( i, 0 );
-        modScale->SetPointEYlow ( i, 0 );
-    }
-    return *modScale;
-}
-
-
-TH1D getSimplifiedScale( const TH1D& h1_fast, const TH1D& h1_full ) {
-    auto h1_scale = *((TH1D*)h1_fast.Clone());
-
-    float intFast = h1_fast.Integral();
-    float intFull = h1_full.Integral();
-
-    for( auto binFast=h1_fast.GetNbinsX()+1; binFast>0; binFast-- ) {
-        auto fastInt = h1_fast.Integral( binFast, -1 )/intFast;
-        int binFull;
-        for( binFull=h1_fast.GetNbinsX()+1; binFull>0; binFull-- ) {
-            auto fullInt = h1_full.Integral( binFull, -1 )/intFull;
-            if( fullInt > fastInt ) break;
-        }
-        h1_scale.SetBinContent( binFast, h1_fast.GetXaxis()->GetBinCenter(binFull)/h1_fast.GetXaxis()->GetBinCenter(binFast) );
-
-    }
-
-
-
-    return h1_scale;
-}
-
-TGraphAsymmErrors getScaleWithUncertainties( const TH1D& h1_fast, const TH1D& h1_full ) {
-    /* For each fastsim energy, calculate the are from -inf to the energy.
-     * Search then the fullsim energy, which corresponds to the same area.
-     * The statistical uncertanity of fullsim, fastsim and the binning uncertainty is taken into account.
-     */
-
-    // This object will be returned
-    TGraphAsymmErrors out = TGraphAsymmErrors();
-    // The x-title will be inherited from the input histo, the y-title is newly set
-    out.SetTitle( (std::string(";")+h1_fast.GetXaxis()->GetTitle()+";Scale    ").c_str() );
-
-    // Unweighted histograms are assumed
-    // A cast to int is done, to bypass numerical (un)precission
-    if( round(h1_fast.GetEntries()) != round(h1_fast.GetEffectiveEntries()) ||
-            round(h1_full.GetEntries()) != round(h1_full.GetEffectiveEntries()) ) {
-        std::cerr << "Please provide unweighted histograms" << std::endl;
-        return out;
-    }
-
-    // Calculate confidence level ( approx 0.683 )
-    double alpha = TMath::Erf( 1./TMath::Sqrt2() );
-
-    // Used for calculating uncertainties
-    TEfficiency eff = TEfficiency();
-
-    int entriesFast = h1_fast.GetEntries();
-    int entriesFull = h1_full.GetEntries();
-
-    int nBinsFast = h1_fast.GetNbinsX()+2;
-    int nBinsFull = h1_fast.GetNbinsX()+2;
-
-    // To improve acess time, the entries of h1_full will be saved as vector
-    std::vector<int> cumulativeFull;
-    cumulativeFull.reserve( nBinsFull );
-    cumulativeFull.push_back( int(h1_full.GetBinContent(0)) );
-    for( int i=1; i<nBinsFull; ++i ) {
-        cumulativeFull.push_back( cumulativeFull.back() + int(h1_full.GetBinContent(i)) );
-    }
-
-    int summedEntriesFast = 0;
-    for( int binFast=1; binFast<nBinsFast; ++binFast ) {
-        summedEntriesFast += h1_fast.GetBinContent( binFast );
-        //double areaFast = summedEntriesFast/entriesFast; // not needed, since the mean is calculated as (up+down)/2
-
-        // Take into account the statistical precission of h1
-        double areaFastUp = eff.ClopperPearson( entriesFast, summedEntriesFast, alpha, true );
-        double areaFastDn = eff.ClopperPearson( entriesFast, summedEntriesFast, alpha, false );
-
-        // Number of entries in the fullsim corresponding to these bondaries
-        int entriesFull_StatFastDn = floor( areaFastDn * entriesFull );
-        int entriesFull_StatFastUp = ceil ( areaFastUp * entriesFull );
-
-
-        // Find the bins in hFull, which corresponds to the same area from hFast
-        // This is the propagation of the statistical uncertainty of hFast to hFull
-        int binFull_StatFastDn = -1;
-        int binFull_StatFastUp = -1;
-        for( int binFull=nBinsFull-1; 0<=binFull; --binFull ) {
-            if( cumulativeFull.at(binFull) >= entriesFull_StatFastDn ) {
-                binFull_StatFastDn = binFull;
-            }
-        }
-        for( int binFull=0; binFull<nBinsFull-1; ++binFull ) {
-            if( cumulativeFull.at(binFull) <= entriesFull_StatFastUp ) {
-                binFull_StatFastUp = binFull;
-            }
-        }
-
-        // Take the middle. This is somehow arbitrary, but feel free to envolve a better method
-        int binFullMiddle = (binFull_StatFastUp + binFull_StatFastDn)/2;
-
-        // Compute the statistical precission of hFull
-        double areaFullUp = eff.ClopperPearson( entriesFull, cumulativeFull.at(binFullMiddle), alpha, true );
-        double areaFullDn = eff.ClopperPearson( entriesFull, cumulativeFull.at(binFullMiddle), alpha, false );
-
-        // Number of entries in the fullsim corresponding to these bondaries
-        int entriesFull_StatFullDn = floor( areaFullDn * entriesFull );
-        int entriesFull_StatFullUp = ceil ( areaFullUp * entriesFull );
-        int binFull_StatFullDn = -1;
-        int binFull_StatFullUp = -1;
-        for( int binFull=nBinsFull-1; 0<=binFull; --binFull ) {
-            if( cumulativeFull.at(binFull) >= entriesFull_StatFullDn ) {
-                binFull_StatFullDn = binFull;
-            }
-        }
-        for( int binFull=0; binFull<nBinsFull-1; ++binFull ) {
-            if( cumulativeFull.at(binFull) <= entriesFull_StatFullUp ) {
-                binFull_StatFullUp = binFull;
-            }
-        }
-
-        // Calculate the scale
-        double efull = h1_fast.GetBinCenter( binFullMiddle );
-        double efast = h1_fast.GetBinCenter( binFast );
-        double scale = efull / efast;
-
-        // add binning uncertanity, assuming equidistant binning
-        double binningUncertSquared = pow( h1_fast.GetBinWidth(1), 2 ) / 12; // assume uniform distribution
-        binningUncertSquared = 0; // binning uncertainty are taken into account by including/excluding the border-bins
-
-        // now combine binning uncertainty, and stat h1 and stat h2
-        double errorUp = sqrt( pow(h1_fast.GetBinCenter( binFull_StatFastUp )-efull, 2 ) + pow(h1_fast.GetBinCenter( binFull_StatFullUp )-efull, 2 ) + binningUncertSquared ) / efast;
-        double errorDn = sqrt( pow(h1_fast.GetBinCenter( binFull_StatFastDn )-efull, 2 ) + pow(h1_fast.GetBinCenter( binFull_StatFullDn )-efull, 2 ) + binningUncertSquared ) / efast;
-
-        out.SetPoint( binFast, efast, scale );
-        out.SetPointError( binFast, 0, 0, errorDn, errorUp );
-    }
-
-    return out;
-
-}
-
 TH1F graphToHisto( const TGraph& gr ) {
     auto h = gr.GetHistogram();
     h->Reset( "ICESM" );
@@ -222,7 +78,7 @@ TH1F graphToHisto( const TGraph& gr ) {
     return *h;
 }
 
-void applyScale( TH1D h1_fast, TH1D h1_full, const TGraphAsymmErrors& scale, const std::string& savename ) {
+void applyScale( TH1D h1_fast, TH1D h1_full, const TGraphAsymmErrors& scale, const std::string& savename, PlotQueue& plots ) {
 
     auto fast_clone = (TH1D*)h1_fast.Clone();
 
@@ -253,20 +109,21 @@ void applyScale( TH1D h1_fast, TH1D h1_full, const TGraphAsymmErrors& scale, con
 
     h1_fast.SetMaximum( 1.05*std::max( h1_fast.GetMaximum(), h1_full.GetMaximum() ) );
 
-    TCanvas* can = new TCanvas();
-    can->cd();
+    TCanvas can;
+    can.cd();
     h1_fast.Draw("hist");
     h1_full.Draw("hist same");
 
-    can->SaveAs( (std::string("plots/")+savename+"_closure.pdf").c_str() );
+    plots.save( can, savename+"_closure" );
 }
 
-void drawAll( TH1D h1_fast, TH1D h1_full, TGraphAsymmErrors scale, TGraphAsymmErrors corrScale, const std::string& savename ) {
+void drawAll( TH1D h1_fast, TH1D h1_full, TGraphAsymmErrors scale, TGraphAsymmErrors corrScale, const std::string& savename, PlotQueue& plots ) {
     // The inputs are cloned, so we can modify them
+    ScopedTimer timer( "drawAll" );
 
 
     // "Closure test"
-    //applyScale( h1_fast, h1_full, corrScale, savename );
+    //applyScale( h1_fast, h1_full, corrScale, savename, plots );
 
     h1_fast.Scale( 1./h1_fast.GetEntries() );
     h1_full.Scale( 1./h1_full.GetEntries() );
@@ -293,8 +150,8 @@ void drawAll( TH1D h1_fast, TH1D h1_full, TGraphAsymmErrors scale, TGraphAsymmEr
 
     h1_fast.SetMaximum( 1.05*std::max( h1_fast.GetMaximum(), h1_full.GetMaximum() ) );
 
-    TCanvas* can = new TCanvas();
-    can->cd();
+    TCanvas can;
+    can.cd();
     h1_fast.Draw("hist");
     h1_full.Draw("hist same");
 
@@ -305,7 +162,7 @@ void drawAll( TH1D h1_fast, TH1D h1_full, TGraphAsymmErrors scale, TGraphAsymmEr
     oneLine->SetLineStyle(2);
     oneLine->DrawLine( h1_fast.GetXaxis()->GetBinLowEdge( minBin ), 1, h1_fast.GetXaxis()->GetBinLowEdge( maxBin+1 ), 1 );
 
-    can->SaveAs( (std::string("plots/")+savename+".pdf").c_str() );
+    plots.save( can, savename );
 
 }
 
@@ -323,50 +180,37 @@ std::string getBinLabel( const TH3F& h3, int xbin, int ybin ) {
 
 }
 
-TH3F calculateResponse( const TH3F& h3_fast, const TH3F& h3_full ) {
-
-    // This is the output histogram
-    auto h3_scale = *((TH3F*)h3_fast.Clone("responseVsEVsEta"));
-    h3_scale.Reset();
-
-    // For each E_gen, eta_gen bin, extract the one dimensional E_sim/E_gen histogram
-    for( int xbin=1; xbin< h3_fast.GetNbinsX()+1; ++xbin ) { // E_gen
-        for( int ybin=1; ybin< h3_fast.GetNbinsY()+1; ++ybin ) { // eta_gen
-
+TH3F calculateResponse( const TH3F& h3_fast, const TH3F& h3_full, PlotQueue& plots, unsigned nThreads=0 ) {
+    // The scale of ScaleCalculation.h, with the distributions and scale of each E_gen, eta_gen bin drawn
+
+    // Copy the inputs once, so each E_gen, eta_gen bin can be accessed without a projection
+    ResponseCube fast( h3_fast );
+    ResponseCube full( h3_full );
+    const TAxis& axis = fast.getZaxis();
+
+    // The plots are drawn in the background in the order of the bins,
+    // and the histograms they own must not be added to a directory.
+    bool addDirectory = TH1::AddDirectoryStatus();
+    TH1::AddDirectory( false );
+    auto h3_scale = calculateResponse( fast, full, bookScale( h3_fast ), nThreads, 0, 0,
+        [&]( const EtaGroup& group, const CellResult& result ) {
+        for( int ybin=group.firstY; ybin<=group.lastY; ++ybin ) { // eta_gen
+            int xbin = group.x; // E_gen
             auto name = getBinLabel( h3_fast, xbin, ybin );
-
-            // Create the 1d histograms
-            auto h1_fast = h3_fast.ProjectionZ( (name+" fast").c_str(), xbin, xbin, ybin, ybin );
-            auto h1_full = h3_full.ProjectionZ( (name+" full").c_str(), xbin, xbin, ybin, ybin );
-
-            if( !h1_fast->GetEntries() || !h1_full->GetEntries() ) continue;
-
+            auto h1_fast = columnToHist( fast.column( xbin, ybin ), axis, name+" fast" );
+            auto h1_full = columnToHist( full.column( xbin, ybin ), axis, name+" full" );
             name += ";E/E_{gen}; Normalized Entries  ";
-            h1_fast->SetTitle( name.c_str() );
-            h1_full->SetTitle( name.c_str() );
-
-/*
-            auto h1_scale = getSimplifiedScale( *h1_fast, *h1_full );
-            for( int i=1;i<h1_scale.GetNbinsX()+1;i++){
-                h3_scale.SetBinContent( xbin, ybin, i, h1_scale.GetBinContent(i) );
-            }
-*/
-
-            auto scale = getScaleWithUncertainties( *h1_fast, *h1_full );
-            auto corrScale = modifyScale( scale, h1_full->GetMean()/h1_fast->GetMean() );
-
-            // Push back the scale into the output histogram
-            for( auto i=0; i<corrScale.GetN(); i++) {
-                double x,y;
-                corrScale.GetPoint(i,x,y);
-                // i+1 corresponds to the z-bin
-                h3_scale.SetBinContent( xbin, ybin, i+1, y );
-            }
+            h1_fast.SetTitle( name.c_str() );
+            h1_full.SetTitle( name.c_str() );
 
             std::string savename = std::to_string(xbin) + "and" + std::to_string(ybin);
-            drawAll( (TH1D)(*h1_fast), (TH1D)(*h1_full), scale, corrScale, savename );
+            plots.add( [=, &plots]() {
+                drawAll( h1_fast, h1_full, result.scale, result.corrScale, savename, plots );
+            } );
         }
     }
+    );
+    TH1::AddDirectory( addDirectory );
 
     return h3_scale;
 }
@@ -428,40 +272,29 @@ TH3F meanResponseAsH3( const TH3F& h3_fast, const TH3F& h3_full ) {
 
 }
 
-TH3F fill3dHist_simple( TChain& chain ) {
+ResponseCube fill3dHist_simple( TChain& chain, unsigned nThreads=0 ) {
     //auto h = TH3F("responseVsEVsEta", ";E_{gen};#eta_{gen};E/E_{gen}", 100, 5, 1005, 400, 0, 3.2, 100, 0.9, 1.05 );
     auto h = TH3F("responseVsEVsEta", ";E_{gen};#eta_{gen};E/E_{gen}", 100, 5, 1005, 400, 0, 3.2, 2000, 0, 1.05 );
     h.Rebin3D(1, 10, 1 );
 
-    float e, eta, r;
-
-    chain.SetBranchAddress( "e", &e );
-    chain.SetBranchAddress( "r", &r );
-    chain.SetBranchAddress( "eta", &eta );
-
-    for( int i=0; i<chain.GetEntries(); i++ ) {
-        chain.GetEntry(i);
-        h.Fill( e, eta, r, 1 );
-    }
-    return h;
+    // Only the binning of h is used. Each thread fills a cube, which stores only the populated bins.
+    ResponseCube cube( *h.GetXaxis(), *h.GetYaxis(), *h.GetZaxis() );
+    return fillParallel<ResponseEvent>( chain, cube, []( ResponseCube& c, const ResponseEvent& event ) {
+        c.fill( event.e, event.eta, event.r );
+    }, nThreads );
 }
 
-TH3F fill3dHist( TChain& chain ) {
+TH3F fill3dHist( TChain& chain, unsigned nThreads=0, const Cut<SimEvent>& cut=Cut<SimEvent>() ) {
     auto h = TH3F("responseVsEVsEta", ";E_{gen};#eta_{gen};E/E_{gen}", 100, 5, 1005, 400, 0, 3.2, 100, 0.9, 1.05 );
     //auto h = TH3F("responseVsEVsEta", ";E_{gen};#eta_{gen};E/E_{gen}", 100, 5, 1005, 400, 0, 3.2, 2000, 0, 1.05 );
     h.Rebin3D(1, 10, 1 );
-    TVector3* genVec = 0;
-    TVector3* simVec = 0;
-    chain.SetBranchAddress( "genVec", &genVec );
-    chain.SetBranchAddress( "hitVec", &simVec );
-    for( int i=0; i<chain.GetEntries(); i++ ) {
-        chain.GetEntry(i);
-        float genE = genVec->Mag();
-        float genEta = genVec->Eta();
-        float oldRes = simVec->Mag() / genVec->Mag();
-        h.Fill( genE, genEta, oldRes );
-    }
-    return h;
+
+    return fillParallel<SimEvent>( chain, h, []( TH3F& h3, const SimEvent& event ) {
+        float genE = event.genE();
+        float genEta = event.genEta();
+        float oldRes = event.response();
+        h3.Fill( genE, genEta, oldRes );
+    }, nThreads, cut );
 }
 
 
@@ -478,37 +311,37 @@ int main_old( int argc, char** argv ) {
 
     auto fastTree = getChain( argv[1], "SimTreeProducer/SimTree" );
     auto fullTree = getChain( argv[2], "SimTreeProducer/SimTree" );
-    const char* cutString = "hitVec.Mag()/genVec.Mag() > 0.9 &&  genVec.Eta()>1.5";
-    //const char* cutString = "genVec.Eta()>0.0035 && genVec.Eta()<1.475";
-    //const char* cutString = "genVec.Eta()>0.0035 && genVec.Eta()<1.475";
-    fastTree = (TChain*)fastTree->CopyTree( cutString );
-    fullTree = (TChain*)fullTree->CopyTree( cutString );
+    // The cut is evaluated while reading, instead of copying the selected events of the trees
+    auto cut = allOf<SimEvent>( { responseAbove<SimEvent>( 0.9 ), etaAbove<SimEvent>( 1.5 ) } );
+    //auto cut = etaBetween<SimEvent>( 0.0035, 1.475 );
+    // String cuts of e, eta and r are compiled once
+    //auto cut = compileCut<SimEvent>( "r > 0.9 && eta > 1.5" );
 
 
-    auto h3d_scale = calculateResponse( fill3dHist( *fastTree ), fill3dHist( *fullTree ) );
+    PlotQueue plots( "plots/scales.pdf", PLOTSAMPLING, 1000, PLOTSPERFILE );
+    auto h3d_scale = calculateResponse( fill3dHist( *fastTree, 0, cut ), fill3dHist( *fullTree, 0, cut ), plots );
     //auto h3d_scale = getHist<TH3F>( "scaleECALFastsim.root", "responseVsEVsEta" );
 
-    TVector3* genVec = 0;
-    TVector3* simVec = 0;
-
-    fastTree->SetBranchAddress( "genVec", &genVec );
-    fastTree->SetBranchAddress( "hitVec", &simVec );
     TH1F h1_fastRes("h1_fastRes", "", 100, 0.9, 1.01 );
-    TH1F h1_fullRes("h1_fullRes", "", 100, 0.9, 1.01 );
 
 
-    for( int i=0; i<fastTree->GetEntries(); i++ ) {
-        fastTree->GetEntry(i);
-        float genE = genVec->Mag();
-        float genEta = genVec->Eta();
-        float oldRes = simVec->Mag() / genVec->Mag();
-        float scale = h3d_scale.GetBinContent( h3d_scale.FindFixBin( genE, genEta, oldRes ) );
-        float newRes = oldRes * scale;
-        h1_fastRes.Fill( newRes );
+    ScaleMap scaleMap( h3d_scale );
+    {
+        ScaleBatch batch( scaleMap, [&]( float, float, float oldRes, float scale, float ) {
+            float newRes = oldRes * scale;
+            h1_fastRes.Fill( newRes );
+        } );
+        // The batch is filled in the order of the entries, so the chunks are read one after the other
+        readParallel<SimEvent>( *fastTree, 1, 1, [&]( int, const SimEvent& event ) {
+            batch.add( event.genE(), event.genEta(), event.response() );
+        }, cut );
     }
-    auto fullTree2 = getChain( argv[2], "SimTreeProducer/SimTree" );
-    fullTree2 = (TChain*)fullTree2->CopyTree( cutString );
-    fullTree2->Draw("hitVec.Mag()/genVec.Mag()>>h1_fullRes", "1", "goff" );
+    auto h1_fullRes = fillParallel<SimEvent>( *fullTree, TH1F("h1_fullRes", "", 100, 0.9, 1.01 ), []( TH1F& h1, const SimEvent& event ) {
+        h1.Fill( event.response() );
+    }, 0, cut );
+
+    // Wait for the plots of the scale, before drawing on this thread
+    plots.finish();
 
     TCanvas c1;
     h1_fullRes.Draw();
@@ -524,31 +357,45 @@ int main_old( int argc, char** argv ) {
 
 int main( int argc, char** argv ) {
     setStyle();
+    ScopedTimer timer( "total" );
 
     auto fastTree = getChain( "../../CMSSW/CMSSW_7_3_0/src/Analyzer/ECALScaleFactorCalculator/3d_fast.root_E30.root", "ecalScaleFactorCalculator/responseTree" );
     auto fullTree = getChain( "../../CMSSW/CMSSW_7_3_0/src/Analyzer/ECALScaleFactorCalculator/3d_full.root_E30.root", "ecalScaleFactorCalculator/responseTree" );
 //    auto h3d_scale = calculateResponse( fill3dHist_simple( *fastTree ), fill3dHist_simple( *fullTree ) );
-    auto h3d_scale = getHist<TH3F>( "scaleECALFastsim.root", "responseVsEVsEta" );
-
+    // The binary scale map is mapped into memory directly, otherwise the histogram is converted
+    std::unique_ptr<ScaleMap> h3d_scale;
+    if( access( "scaleECALFastsim.scalemap", R_OK ) == 0 ) {
+        h3d_scale.reset( new ScaleMap( "scaleECALFastsim.scalemap" ) );
+    } else {
+        h3d_scale.reset( new ScaleMap( getHist<TH3F>( "scaleECALFastsim.root", "responseVsEVsEta" ) ) );
+    }
 
 
 
-    float e, eta, r;
 
-    fastTree->SetBranchAddress( "e", &e );
-    fastTree->SetBranchAddress( "r", &r );
-    fastTree->SetBranchAddress( "eta", &eta );
     TH1F h1_fastRes("h1_fastRes", "", 100, 0.9, 1.01 );
-    TH1F h1_fullRes("h1_fullRes", "", 100, 0.9, 1.01 );
 
 
-    for( int i=0; i<fastTree->GetEntries(); i++ ) {
-        fastTree->GetEntry(i);
-        float scale = h3d_scale.GetBinContent( h3d_scale.FindFixBin( e,eta,r ) );
-        float newRes = r * scale;
-        h1_fastRes.Fill( newRes );
+    // Use the binned scale, or interpolate trilinearly between the bin centers
+    bool interpolateScale = false;
+    {
+        ScopedTimer applyTimer( "applyScale" );
+        ScaleBatch batch( *h3d_scale, [&]( float, float, float oldRes, float scale, float ) {
+            float newRes = oldRes * scale;
+            h1_fastRes.Fill( newRes );
+        }, false, interpolateScale );
+        // The batch is filled in the order of the entries, so the chunks are read one after the other.
+        // If the tree has a column cache, it is read from there.
+        long long nEntries = 0;
+        readParallel<ResponseEvent>( *fastTree, 1, 1, [&]( int, const ResponseEvent& event ) {
+            batch.add( event.e, event.eta, event.r );
+            nEntries++;
+        } );
+        addCount( "eventsScaled", nEntries );
     }
-    fullTree->Draw("r>>h1_fullRes", "1", "goff" );
+    auto h1_fullRes = fillParallel<ResponseEvent>( *fullTree, TH1F("h1_fullRes", "", 100, 0.9, 1.01 ), []( TH1F& h1, const ResponseEvent& event ) {
+        h1.Fill( event.r );
+    } );
 
     TCanvas c1;
     h1_fullRes.Draw();
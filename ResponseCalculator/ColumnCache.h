@@ -0,0 +1,185 @@
+#ifndef COLUMNCACHE_H
+#define COLUMNCACHE_H
+
+#include<cstdint>
+#include<cstdlib>
+#include<cstring>
+#include<fstream>
+#include<iostream>
+#include<memory>
+#include<string>
+#include<vector>
+
+// memory mapping
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+// user incuded files
+#include "Instrumentation.h"
+
+/* Binary format of the column cache of one tree of one input file:
+ *   ColumnCacheHeader
+ *   float columns[nColumns][nEntries]   each column starts at a multiple of COLUMNALIGNMENT bytes
+ * The columns are E_gen, eta_gen and E_sim/E_gen, and the components of the hit vector if hasHits is set.
+ * The cache is memory mapped, so the events are read without decompression and streaming.
+ */
+
+const char COLUMNCACHEMAGIC[8] = { 'E', 'C', 'A', 'L', 'C', 'O', 'L', '\0' };
+const uint32_t COLUMNCACHEVERSION = 1;
+const size_t COLUMNALIGNMENT = 64;
+
+// Directory of the caches. If empty, the cache of input.root is input.root.columns.
+std::string COLUMNCACHEDIR = "";
+
+enum ColumnIndex { COLUMNE, COLUMNETA, COLUMNR, COLUMNHITX, COLUMNHITY, COLUMNHITZ };
+
+struct ColumnCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t hasHits;
+    uint64_t nEntries;
+    // Size and modification time of the input file, the cache is not used if they changed
+    int64_t sourceSize;
+    int64_t sourceTime;
+    char treename[128];
+};
+static_assert( sizeof(ColumnCacheHeader) % 8 == 0, "The header has to be aligned" );
+
+size_t alignColumn( size_t bytes ) {
+    return ( bytes+COLUMNALIGNMENT-1 )/COLUMNALIGNMENT*COLUMNALIGNMENT;
+}
+
+std::string getColumnCacheName( const std::string& source ) {
+    if( COLUMNCACHEDIR.empty() ) return source + ".columns";
+    return COLUMNCACHEDIR + "/" + source.substr( source.find_last_of( '/' )+1 ) + ".columns";
+}
+
+bool getSourceInfo( const std::string& source, int64_t& size, int64_t& time ) {
+    // Returns false for remote files, which can not be checked
+    struct stat info;
+    size = time = 0;
+    if( stat( source.c_str(), &info ) != 0 ) return false;
+    size = info.st_size;
+    time = info.st_mtime;
+    return true;
+}
+
+class ColumnCache {
+    /* Read-only memory mapped column cache of a tree, see makeColumnCache.
+     */
+  public:
+    ColumnCache( const std::string& filename ) {
+        int fd = open( filename.c_str(), O_RDONLY );
+        struct stat info;
+        if( fd < 0 || fstat( fd, &info ) != 0 || size_t(info.st_size) < sizeof(ColumnCacheHeader) ) {
+            std::cerr << "ERROR: Could not open column cache " << filename << std::endl;
+            exit(1);
+        }
+        mappedSize_ = info.st_size;
+        mapped_ = mmap( 0, mappedSize_, PROT_READ, MAP_SHARED, fd, 0 );
+        close( fd );
+        if( mapped_ == MAP_FAILED ) {
+            std::cerr << "ERROR: Could not map column cache " << filename << std::endl;
+            exit(1);
+        }
+        std::memcpy( &header_, mapped_, sizeof(ColumnCacheHeader) );
+        if( std::memcmp( header_.magic, COLUMNCACHEMAGIC, sizeof(COLUMNCACHEMAGIC) ) ||
+                header_.version != COLUMNCACHEVERSION || mappedSize_ != getFileSize( header_ ) ) {
+            std::cerr << "ERROR: " << filename << " is not a valid column cache" << std::endl;
+            exit(1);
+        }
+        // The events are read sequentially
+        madvise( mapped_, mappedSize_, MADV_SEQUENTIAL );
+    }
+
+    ~ColumnCache() {
+        munmap( mapped_, mappedSize_ );
+    }
+
+    ColumnCache( const ColumnCache& ) = delete;
+    ColumnCache& operator=( const ColumnCache& ) = delete;
+
+    const float* column( int index ) const {
+        return (const float*)( (const char*)mapped_ + getColumnOffset( header_, index ) );
+    }
+
+    long long getEntries() const { return header_.nEntries; }
+    bool hasHits() const { return header_.hasHits; }
+    const ColumnCacheHeader& getHeader() const { return header_; }
+
+    static int getNColumns( const ColumnCacheHeader& header ) { return header.hasHits ? 6 : 3; }
+
+    static size_t getColumnOffset( const ColumnCacheHeader& header, int index ) {
+        return alignColumn( sizeof(ColumnCacheHeader) ) + index*alignColumn( header.nEntries*sizeof(float) );
+    }
+
+    static size_t getFileSize( const ColumnCacheHeader& header ) {
+        return getColumnOffset( header, getNColumns( header ) );
+    }
+
+  private:
+    ColumnCacheHeader header_;
+    void* mapped_ = 0;
+    size_t mappedSize_ = 0;
+};
+
+std::unique_ptr<ColumnCache> findColumnCache( const std::string& source, const std::string& treename ) {
+    // The cache of the tree in the source file, if it exists and the source did not change since it was written.
+    // The caches of remote sources are never used, since their size and modification time are not known.
+    std::string filename = getColumnCacheName( source );
+    ColumnCacheHeader header;
+    std::ifstream file( filename.c_str(), std::ios::binary );
+    if( !file.read( (char*)&header, sizeof(ColumnCacheHeader) ) ) return std::unique_ptr<ColumnCache>();
+    int64_t size, time;
+    if( !getSourceInfo( source, size, time ) ) {
+        std::cerr << "WARNING: Ignoring column cache " << filename << ", since " << source << " can not be checked" << std::endl;
+        return std::unique_ptr<ColumnCache>();
+    }
+    if( treename != std::string( header.treename, strnlen( header.treename, sizeof(header.treename) ) ) ||
+            header.sourceSize != size || header.sourceTime != time ) {
+        std::cerr << "WARNING: Ignoring column cache " << filename << " of another tree or an older input file" << std::endl;
+        return std::unique_ptr<ColumnCache>();
+    }
+    return std::unique_ptr<ColumnCache>( new ColumnCache( filename ) );
+}
+
+void writeColumnCache( const std::string& source, const std::string& treename, const std::vector<std::vector<float>>& columns ) {
+    // Writes the columns of the tree in the source file, all columns have the same length
+    ScopedTimer timer( "writeColumnCache" );
+    ColumnCacheHeader header;
+    std::memset( &header, 0, sizeof(ColumnCacheHeader) );
+    std::memcpy( header.magic, COLUMNCACHEMAGIC, sizeof(COLUMNCACHEMAGIC) );
+    header.version = COLUMNCACHEVERSION;
+    header.hasHits = columns.size() == 6;
+    header.nEntries = columns[0].size();
+    if( !getSourceInfo( source, header.sourceSize, header.sourceTime ) ) {
+        std::cerr << "ERROR: " << source << " is not a local file, its column cache could not be validated" << std::endl;
+        exit(1);
+    }
+    if( treename.size() >= sizeof(header.treename) ) {
+        std::cerr << "ERROR: Tree name " << treename << " is too long for the column cache" << std::endl;
+        exit(1);
+    }
+    std::strncpy( header.treename, treename.c_str(), sizeof(header.treename) );
+
+    std::string filename = getColumnCacheName( source );
+    std::ofstream file( filename.c_str(), std::ios::binary );
+    file.write( (const char*)&header, sizeof(ColumnCacheHeader) );
+    std::vector<char> padding( COLUMNALIGNMENT, 0 );
+    size_t position = sizeof(ColumnCacheHeader);
+    for( int index=0; index<ColumnCache::getNColumns( header ); ++index ) {
+        size_t offset = ColumnCache::getColumnOffset( header, index );
+        file.write( padding.data(), offset-position );
+        file.write( (const char*)columns[index].data(), header.nEntries*sizeof(float) );
+        position = offset + header.nEntries*sizeof(float);
+    }
+    file.write( padding.data(), ColumnCache::getFileSize( header )-position );
+    if( !file ) {
+        std::cerr << "ERROR: Could not write column cache " << filename << std::endl;
+        exit(1);
+    }
+}
+
+#endif
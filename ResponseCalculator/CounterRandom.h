@@ -0,0 +1,93 @@
+#ifndef COUNTERRANDOM_H
+#define COUNTERRANDOM_H
+
+#include<cmath>
+#include<cstddef>
+#include<cstdint>
+
+uint64_t mix64( uint64_t x ) {
+    // Finalizer of SplitMix64: a bijection, which maps neighbouring inputs to unrelated outputs
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+    return x ^ ( x >> 31 );
+}
+
+uint64_t streamKey( uint64_t seed, uint64_t a, uint64_t b=0, uint64_t c=0 ) {
+    // Key of the stream for e.g. seed, cell and replica
+    return mix64( mix64( mix64( mix64( seed ) ^ a ) ^ b ) ^ c );
+}
+
+const uint64_t COUNTERINCREMENT = 0x9e3779b97f4a7c15ULL;
+
+double toUniform( uint64_t x ) {
+    // In (0,1), with 53 random bits
+    return ( ( x >> 11 ) + 0.5 ) * ( 1./9007199254740992. );
+}
+
+class CounterRandom {
+    /* Counter-based random numbers: the i-th number of a stream is a function of the key and i only.
+     * Each unit of work (cell, replica, block of events, ...) gets its own stream, so the results
+     * do not depend on which thread processes it or in which order.
+     */
+  public:
+    CounterRandom( uint64_t key, uint64_t counter=0 ) :
+        key_( mix64( key ) ),
+        counter_( counter )
+    {}
+
+    uint64_t next() {
+        return mix64( key_ + COUNTERINCREMENT * ++counter_ );
+    }
+
+    double uniform() { return toUniform( next() ); }
+
+    int poisson( double mean ) {
+        if( mean <= 0 ) return 0;
+        if( mean < 10 ) {
+            // Inversion by sequential search
+            double p = exp( -mean ), sum = p, u = uniform();
+            int k = 0;
+            while( u > sum && k < 1000 ) {
+                p *= mean/++k;
+                sum += p;
+            }
+            return k;
+        }
+        // Transformed rejection with squeeze (PTRS) of Hoermann, with constant expected cost
+        double smu = sqrt( mean );
+        double b = 0.931 + 2.53*smu;
+        double a = -0.059 + 0.02483*b;
+        double invAlpha = 1.1239 + 1.1328/( b-3.4 );
+        double vr = 0.9277 - 3.6224/( b-2 );
+        while( true ) {
+            double u = uniform() - 0.5;
+            double v = uniform();
+            double us = 0.5 - std::abs( u );
+            double k = floor( ( 2*a/us + b )*u + mean + 0.43 );
+            if( us >= 0.07 && v <= vr ) return k;
+            if( k < 0 || ( us < 0.013 && v > us ) ) continue;
+            if( log( v*invAlpha/( a/( us*us ) + b ) ) <= -mean + k*log( mean ) - lgamma( k+1 ) ) return k;
+        }
+    }
+
+    uint64_t getCounter() const { return counter_; }
+
+  private:
+    uint64_t key_;
+    uint64_t counter_;
+};
+
+void gaussians( uint64_t key, const uint64_t* counters, size_t n, double* out ) {
+    /* Standard normal numbers for a block of counters, e.g. entry numbers, by the Box-Muller transform.
+     * The i-th number only depends on key and counters[i], and the loop has no branches,
+     * so it can be vectorized.
+     */
+    uint64_t mixedKey = mix64( key );
+    for( size_t i=0; i<n; ++i ) {
+        double u1 = toUniform( mix64( mixedKey + COUNTERINCREMENT * ( 2*counters[i]+1 ) ) );
+        double u2 = toUniform( mix64( mixedKey + COUNTERINCREMENT * ( 2*counters[i]+2 ) ) );
+        out[i] = sqrt( -2*log( u1 ) ) * cos( 2*M_PI*u2 );
+    }
+}
+
+#endif
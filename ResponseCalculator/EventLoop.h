@@ -0,0 +1,381 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include<algorithm>
+#include<cmath>
+#include<functional>
+#include<memory>
+#include<string>
+#include<vector>
+
+// ROOT
+#include<TChain.h>
+#include<TObjArray.h>
+#include<TROOT.h>
+#include<TTree.h>
+#include<TVector3.h>
+
+// user incuded files
+#include "CellScheduler.h"
+#include "ColumnCache.h"
+#include "Instrumentation.h"
+#include "Selection.h"
+
+// Size of the TTreeCache of each thread, the baskets of the active branches are read in blocks of this size
+const long long CACHESIZE = 30*1024*1024;
+
+struct ResponseEvent {
+    // Flat branches of the ecalScaleFactorCalculator/responseTree
+    float e, eta, r;
+
+    void connect( TTree& tree ) {
+        tree.SetBranchStatus( "*", 0 );
+        for( auto name : { "e", "eta", "r" } ) {
+            tree.SetBranchStatus( name, 1 );
+            tree.AddBranchToCache( name, true );
+        }
+        tree.SetBranchAddress( "e", &e );
+        tree.SetBranchAddress( "eta", &eta );
+        tree.SetBranchAddress( "r", &r );
+    }
+
+    bool read( TTree& tree, long long entry ) {
+        return tree.GetEntry( entry ) > 0;
+    }
+
+    void read( const ColumnCache& cache, long long i ) {
+        e = cache.column( COLUMNE )[i];
+        eta = cache.column( COLUMNETA )[i];
+        r = cache.column( COLUMNR )[i];
+    }
+
+    // Same interface as SimEvent, for the cuts
+    double genE() const { return e; }
+    double genEta() const { return eta; }
+    double response() const { return r; }
+};
+
+struct SimEvent {
+    /* genVec and hitVec of the SimTreeProducer/SimTree.
+     * If the TVector3 branches are split, only the coordinates are read,
+     * otherwise the full objects have to be streamed.
+     */
+    double genX, genY, genZ;
+    double hitX, hitY, hitZ;
+
+    SimEvent() {}
+    SimEvent( const SimEvent& ) = delete;
+    SimEvent& operator=( const SimEvent& ) = delete;
+
+    void connect( TTree& tree ) {
+        tree.SetBranchStatus( "*", 0 );
+        split_ = tree.GetBranch( "genVec.fX" ) && tree.GetBranch( "hitVec.fX" );
+        if( split_ ) {
+            const char* names[] = { "genVec.fX", "genVec.fY", "genVec.fZ", "hitVec.fX", "hitVec.fY", "hitVec.fZ" };
+            double* addresses[] = { &genX, &genY, &genZ, &hitX, &hitY, &hitZ };
+            for( int i=0; i<6; ++i ) {
+                tree.SetBranchStatus( names[i], 1 );
+                tree.AddBranchToCache( names[i], true );
+                tree.SetBranchAddress( names[i], addresses[i] );
+            }
+        } else {
+            for( auto name : { "genVec*", "hitVec*" } ) {
+                tree.SetBranchStatus( name, 1 );
+                tree.AddBranchToCache( name, true );
+            }
+            tree.SetBranchAddress( "genVec", &genVec_ );
+            tree.SetBranchAddress( "hitVec", &hitVec_ );
+        }
+    }
+
+    bool read( TTree& tree, long long entry ) {
+        if( tree.GetEntry( entry ) <= 0 ) return false;
+        if( !split_ ) {
+            genX = genVec_->X(); genY = genVec_->Y(); genZ = genVec_->Z();
+            hitX = hitVec_->X(); hitY = hitVec_->Y(); hitZ = hitVec_->Z();
+        }
+        return true;
+    }
+
+    void read( const ColumnCache& cache, long long i ) {
+        /* The cache stores E_gen and eta_gen instead of the generated vector, which is
+         * restored at phi = 0. Without hit vector, it points in the same direction.
+         */
+        double e = cache.column( COLUMNE )[i];
+        double eta = cache.column( COLUMNETA )[i];
+        double r = cache.column( COLUMNR )[i];
+        genX = e/cosh( eta );
+        genY = 0;
+        genZ = e*tanh( eta );
+        if( cache.hasHits() ) {
+            hitX = cache.column( COLUMNHITX )[i];
+            hitY = cache.column( COLUMNHITY )[i];
+            hitZ = cache.column( COLUMNHITZ )[i];
+        } else {
+            hitX = r*genX;
+            hitY = 0;
+            hitZ = r*genZ;
+        }
+    }
+
+    // Same as TVector3::Mag() and TVector3::Eta()
+    double genE() const { return sqrt( genX*genX + genY*genY + genZ*genZ ); }
+    double hitE() const { return sqrt( hitX*hitX + hitY*hitY + hitZ*hitZ ); }
+    double genEta() const {
+        double cosTheta = genE() == 0 ? 1 : genZ/genE();
+        if( cosTheta*cosTheta < 1 ) return -0.5*log( (1-cosTheta)/(1+cosTheta) );
+        if( genZ == 0 ) return 0;
+        return genZ > 0 ? 10e10 : -10e10;
+    }
+    double response() const { return hitE() / genE(); }
+
+    ~SimEvent() {
+        delete genVec_;
+        delete hitVec_;
+    }
+
+  private:
+    bool split_ = false;
+    TVector3* genVec_ = 0;
+    TVector3* hitVec_ = 0;
+};
+
+std::vector<std::string> getFileNames( TChain& chain ) {
+    std::vector<std::string> names;
+    auto files = chain.GetListOfFiles();
+    for( int i=0; i<files->GetEntries(); ++i ) {
+        names.push_back( files->At(i)->GetTitle() );
+    }
+    return names;
+}
+
+bool findColumnCaches( TChain& chain, std::vector<std::unique_ptr<ColumnCache>>& caches ) {
+    // The caches of all files of the chain, if they all exist
+    caches.clear();
+    for( auto& file : getFileNames( chain ) ) {
+        caches.push_back( findColumnCache( file, chain.GetName() ) );
+        if( !caches.back() ) return false;
+    }
+    return !caches.empty();
+}
+
+template <class EVENT, class FUNC>
+void readColumnCaches( const std::vector<std::unique_ptr<ColumnCache>>& caches, int nChunks, unsigned nThreads, FUNC process, const Cut<EVENT>& cut ) {
+    // Same as readParallel, but the events are read from the memory mapped caches of the files of the chain
+    long long nEntries = 0;
+    for( auto& cache : caches ) nEntries += cache->getEntries();
+    auto eventsRead = getCounter( "eventsRead" );
+    auto eventsRejected = getCounter( "eventsRejected" );
+    auto eventsFromCache = getCounter( "eventsReadFromCache" );
+
+    runCells( nChunks, nThreads, [&]( int chunk ) {
+        long long first = nEntries*chunk/nChunks;
+        long long last  = nEntries*(chunk+1)/nChunks;
+        EVENT event;
+        long long offset = 0, nRejected = 0;
+        for( auto& cache : caches ) {
+            long long begin = std::max( first, offset );
+            long long end = std::min( last, offset+cache->getEntries() );
+            for( long long i=begin; i<end; ++i ) {
+                event.read( *cache, i-offset );
+                if( passes( cut, event ) ) process( chunk, event );
+                else nRejected++;
+            }
+            offset += cache->getEntries();
+        }
+        addCount( eventsRead, last-first );
+        addCount( eventsFromCache, last-first );
+        addCount( eventsRejected, nRejected );
+    } );
+}
+
+template <class EVENT, class FUNC>
+void readParallel( TTree& tree, int nChunks, unsigned nThreads, FUNC process, const Cut<EVENT>& cut=Cut<EVENT>() ) {
+    /* Splits the entries of the tree in nChunks consecutive ranges, which are read in parallel.
+     * Each thread opens its own chain and reads only the branches needed by EVENT, in blocks
+     * through the TTreeCache. process( chunk, event ) is called for each entry of the chunk in order,
+     * which passes the cut.
+     * If all files of the chain have a column cache, see makeColumnCache, the events are read from the caches.
+     * Trees which only exist in memory (e.g. from CopyTree) can not be reopened and are read serially.
+     */
+    ScopedTimer timer( "readTree" );
+    auto chain = dynamic_cast<TChain*>( &tree );
+    std::vector<std::unique_ptr<ColumnCache>> caches;
+    if( chain && findColumnCaches( *chain, caches ) ) {
+        readColumnCaches<EVENT>( caches, nChunks, nThreads, process, cut );
+        return;
+    }
+
+    long long nEntries = tree.GetEntries();
+    auto eventsRead = getCounter( "eventsRead" );
+    auto eventsRejected = getCounter( "eventsRejected" );
+
+    if( !chain ) {
+        EVENT event;
+        event.connect( tree );
+        for( int chunk=0; chunk<nChunks; ++chunk ) {
+            long long first = nEntries*chunk/nChunks;
+            long long last = nEntries*(chunk+1)/nChunks;
+            long long i = first, nRejected = 0;
+            for( ; i<last; ++i ) {
+                if( !event.read( tree, i ) ) break;
+                if( passes( cut, event ) ) process( chunk, event );
+                else nRejected++;
+            }
+            addCount( eventsRead, i-first );
+            addCount( eventsRejected, nRejected );
+        }
+        // The tree must not point to the buffers of the event anymore
+        tree.ResetBranchAddresses();
+        tree.SetBranchStatus( "*", 1 );
+        return;
+    }
+
+    auto files = getFileNames( *chain );
+    std::string treename = chain->GetName();
+
+    ROOT::EnableThreadSafety();
+
+    runCells( nChunks, nThreads, [&]( int chunk ) {
+        long long first = nEntries*chunk/nChunks;
+        long long last  = nEntries*(chunk+1)/nChunks;
+        if( first == last ) return;
+
+        // The event owns the branch buffers, so it has to outlive the chain
+        EVENT event;
+        TChain localChain( treename.c_str() );
+        for( auto& file : files ) localChain.AddFile( file.c_str() );
+        localChain.SetCacheSize( CACHESIZE );
+
+        event.connect( localChain );
+        localChain.SetCacheEntryRange( first, last );
+
+        long long i = first, nRejected = 0;
+        for( ; i<last; ++i ) {
+            if( !event.read( localChain, i ) ) break;
+            if( passes( cut, event ) ) process( chunk, event );
+            else nRejected++;
+        }
+        addCount( eventsRead, i-first );
+        addCount( eventsRejected, nRejected );
+    } );
+}
+
+typedef std::function<void(int,const ResponseEvent&)> ResponseConsumer;
+
+void readOnce( TTree& tree, int nChunks, unsigned nThreads, const std::vector<ResponseConsumer>& consumers ) {
+    /* Reads the tree once and passes each event to all consumers. Like for readParallel,
+     * the consumers are called in parallel for different chunks, and have to keep their state per chunk.
+     */
+    readParallel<ResponseEvent>( tree, nChunks, nThreads, [&]( int chunk, const ResponseEvent& event ) {
+        for( auto& consumer : consumers ) consumer( chunk, event );
+    } );
+}
+
+class ResponseColumns {
+    /* In-memory copy of e, eta and r of all entries of a tree, for consumers which need the results
+     * of an earlier pass. All entries are stored in order, so the entry numbers are known.
+     */
+  public:
+    ResponseColumns( int nChunks ) :
+        e_( nChunks ),
+        eta_( nChunks ),
+        r_( nChunks )
+    {}
+
+    ResponseConsumer consumer() {
+        return [this]( int chunk, const ResponseEvent& event ) {
+            e_[chunk].push_back( event.e );
+            eta_[chunk].push_back( event.eta );
+            r_[chunk].push_back( event.r );
+        };
+    }
+
+    int getNChunks() const { return e_.size(); }
+    long long getEntries() const {
+        long long nEntries = 0;
+        for( auto& chunk : e_ ) nEntries += chunk.size();
+        return nEntries;
+    }
+
+    template <class FUNC>
+    void forEach( unsigned nThreads, FUNC process ) const {
+        // Calls process( chunk, entry, event ) for all cached entries, the chunks in parallel
+        std::vector<long long> firstEntries( 1, 0 );
+        for( auto& chunk : e_ ) firstEntries.push_back( firstEntries.back() + chunk.size() );
+        runCells( getNChunks(), nThreads, [&]( int chunk ) {
+            long long first = firstEntries[chunk];
+            ResponseEvent event;
+            for( size_t i=0; i<e_[chunk].size(); ++i ) {
+                event.e = e_[chunk][i];
+                event.eta = eta_[chunk][i];
+                event.r = r_[chunk][i];
+                process( chunk, first+i, event );
+            }
+        } );
+    }
+
+  private:
+    std::vector<std::vector<float>> e_, eta_, r_;
+};
+
+class ResponseStream {
+    /* Same interface as ResponseColumns, but the events are read again from the tree, or its column cache,
+     * in each pass instead of being kept in memory. The chunks and entry numbers are the same as for
+     * ResponseColumns filled by readOnce with the same number of chunks.
+     */
+  public:
+    ResponseStream( TTree& tree, int nChunks ) :
+        tree_( &tree ),
+        nChunks_( nChunks )
+    {}
+
+    int getNChunks() const { return nChunks_; }
+    long long getEntries() const {
+        auto chain = dynamic_cast<TChain*>( tree_ );
+        std::vector<std::unique_ptr<ColumnCache>> caches;
+        if( !chain || !findColumnCaches( *chain, caches ) ) return tree_->GetEntries();
+        long long nEntries = 0;
+        for( auto& cache : caches ) nEntries += cache->getEntries();
+        return nEntries;
+    }
+
+    template <class FUNC>
+    void forEach( unsigned nThreads, FUNC process ) const {
+        // Calls process( chunk, entry, event ) for all entries, the chunks in parallel
+        long long nEntries = getEntries();
+        std::vector<long long> entries( nChunks_ );
+        for( int chunk=0; chunk<nChunks_; ++chunk ) entries[chunk] = nEntries*chunk/nChunks_;
+        readParallel<ResponseEvent>( *tree_, nChunks_, nThreads, [&]( int chunk, const ResponseEvent& event ) {
+            process( chunk, entries[chunk]++, event );
+        } );
+    }
+
+  private:
+    TTree* tree_;
+    int nChunks_;
+};
+
+template <class HIST>
+void mergePartial( HIST& result, const HIST& partial ) {
+    result.Add( &partial );
+}
+
+template <class EVENT, class HIST, class FILL>
+HIST fillParallel( TTree& tree, const HIST& booked, FILL fill, unsigned nThreads=0, const Cut<EVENT>& cut=Cut<EVENT>() ) {
+    // Fills a copy of the booked histogram per chunk with the events passing the cut, which are merged in order at the end.
+    int nChunks = getNumberOfThreads( nThreads );
+    std::vector<HIST> partials( nChunks, booked );
+
+    readParallel<EVENT>( tree, nChunks, nChunks, [&]( int chunk, const EVENT& event ) {
+        fill( partials[chunk], event );
+    }, cut );
+
+    HIST result( partials[0] );
+    for( int chunk=1; chunk<nChunks; ++chunk ) {
+        mergePartial( result, partials[chunk] );
+    }
+    return result;
+}
+
+#endif
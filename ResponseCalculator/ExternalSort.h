@@ -0,0 +1,301 @@
+#ifndef EXTERNALSORT_H
+#define EXTERNALSORT_H
+
+#include<algorithm>
+#include<cstdint>
+#include<cstdlib>
+#include<functional>
+#include<iostream>
+#include<mutex>
+#include<queue>
+#include<string>
+#include<vector>
+
+// files
+#include<fcntl.h>
+#include<unistd.h>
+
+// user incuded files
+#include "CellSamples.h"
+#include "CellScheduler.h"
+#include "Instrumentation.h"
+
+// If > 0, the unbinned scale keeps at most this many MB of events of each input in memory.
+// The events are written as sorted runs to files in SCRATCHDIR, which are merged for each E_gen, eta_gen bin.
+// Both are set by the options -M and -T of unbinnedScaling.
+size_t MEMORYBUDGET = 0;
+std::string SCRATCHDIR = "/tmp";
+
+// Number of values read at once from each run during the merge
+const size_t RUNBLOCKSIZE = 4096;
+
+// Maximal number of runs, which are merged at once. More runs are merged to longer runs first,
+// so the number of open scratch files stays bounded.
+const size_t MERGEFANIN = 64;
+
+// Bytes per buffered event: cell and value, the values grouped by cell and the radix keys while the run is sorted
+const size_t BYTESPEREVENT = 20;
+
+struct SortedRun {
+    // File with the sorted values of each cell, the values of cell i are at offsets[i] to offsets[i+1]
+    int fd;
+    std::vector<size_t> offsets;
+    // Number of merges, which produced the run: 0 for the runs written from memory
+    int level;
+};
+
+int createScratchFile() {
+    // The file stays accessible through the descriptor, and is deleted when it is closed
+    std::string name = SCRATCHDIR + "/sortedRunXXXXXX";
+    std::vector<char> filename( name.begin(), name.end() );
+    filename.push_back( '\0' );
+    int fd = mkstemp( filename.data() );
+    if( fd < 0 ) {
+        std::cerr << "ERROR: Could not create a scratch file in " << SCRATCHDIR << std::endl;
+        exit(1);
+    }
+    unlink( filename.data() );
+    return fd;
+}
+
+void writeValues( int fd, const float* values, size_t n ) {
+    const char* data = (const char*)values;
+    size_t bytes = n*sizeof(float);
+    for( size_t written=0; written<bytes; ) {
+        ssize_t w = write( fd, data+written, bytes-written );
+        if( w <= 0 ) {
+            std::cerr << "ERROR: Could not write a sorted run to " << SCRATCHDIR << std::endl;
+            exit(1);
+        }
+        written += w;
+    }
+    addCount( "bytesSpilled", bytes );
+}
+
+class SortedRuns {
+    /* Values of all events grouped by cell, like CellSamples, but with bounded memory.
+     * Each chunk buffers its events, and writes them as sorted run to a scratch file when the
+     * buffer is full. The sorted values of a cell are obtained by merging its part of all runs.
+     * Once MERGEFANIN runs of the same level exist, they are merged to one run of the next level,
+     * and finish() merges the remaining runs until at most MERGEFANIN are left.
+     * The scratch files are deleted when they are closed.
+     */
+  public:
+    SortedRuns( int nCells, int nChunks, size_t budgetMB ) :
+        nCells_( nCells ),
+        maxBuffered_( std::max<size_t>( 1, budgetMB*1024*1024/BYTESPEREVENT/nChunks ) ),
+        cells_( nChunks ),
+        values_( nChunks ),
+        sizes_( nCells, 0 )
+    {}
+
+    ~SortedRuns() {
+        for( auto& run : runs_ ) close( run.fd );
+    }
+
+    SortedRuns( const SortedRuns& ) = delete;
+    SortedRuns& operator=( const SortedRuns& ) = delete;
+
+    void add( int chunk, int cell, float value ) {
+        cells_[chunk].push_back( cell );
+        values_[chunk].push_back( value );
+        if( cells_[chunk].size() >= maxBuffered_ ) spill( chunk );
+    }
+
+    void finish( unsigned nThreads=0 ) {
+        // Writes the remaining events, after all events are added
+        runCells( cells_.size(), nThreads, [&]( int chunk ) { spill( chunk ); } );
+        while( runs_.size() > MERGEFANIN ) {
+            // The shortest runs are merged first
+            std::stable_sort( runs_.begin(), runs_.end(), []( const SortedRun& a, const SortedRun& b ) { return a.level < b.level; } );
+            std::vector<SortedRun> merged( runs_.begin(), runs_.begin()+MERGEFANIN );
+            runs_.erase( runs_.begin(), runs_.begin()+MERGEFANIN );
+            runs_.push_back( merge( merged ) );
+        }
+    }
+
+    int getNCells() const { return nCells_; }
+    size_t size( int cell ) const { return sizes_[cell]; }
+    size_t size() const {
+        size_t n = 0;
+        for( auto s : sizes_ ) n += s;
+        return n;
+    }
+    const std::vector<SortedRun>& getRuns() const { return runs_; }
+
+  private:
+    void spill( int chunk ) {
+        if( cells_[chunk].empty() ) return;
+        static auto spillTimer = getTimer( "spillRuns" );
+        ScopedTimer timer( spillTimer );
+
+        std::vector<std::vector<int>> cells( 1 );
+        std::vector<std::vector<float>> values( 1 );
+        cells[0].swap( cells_[chunk] );
+        values[0].swap( values_[chunk] );
+        CellSamples samples( nCells_, cells, values );
+        std::vector<int>().swap( cells[0] );
+        std::vector<float>().swap( values[0] );
+        samples.sort( 1 );
+
+        SortedRun run;
+        run.fd = createScratchFile();
+        run.level = 0;
+        writeValues( run.fd, samples.values.data(), samples.values.size() );
+        run.offsets = samples.offsets;
+
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            for( int cell=0; cell<nCells_; ++cell ) sizes_[cell] += samples.size( cell );
+        }
+        addCount( "sortedRuns", 1 );
+        addRun( run );
+    }
+
+    void addRun( SortedRun run ) {
+        // Adds the run, and merges the runs of its level, if there are MERGEFANIN of them
+        while( true ) {
+            std::vector<SortedRun> merged;
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                runs_.push_back( run );
+                size_t nLevel = 0;
+                for( auto& other : runs_ ) nLevel += other.level == run.level;
+                if( nLevel < MERGEFANIN ) return;
+                auto end = std::stable_partition( runs_.begin(), runs_.end(), [&]( const SortedRun& other ) { return other.level != run.level; } );
+                merged.assign( end, runs_.end() );
+                runs_.erase( end, runs_.end() );
+            }
+            // The merge does not block the other chunks
+            run = merge( merged );
+        }
+    }
+
+    SortedRun merge( const std::vector<SortedRun>& runs ) const;
+
+    int nCells_;
+    size_t maxBuffered_;
+    std::vector<std::vector<int>> cells_;
+    std::vector<std::vector<float>> values_;
+    std::vector<size_t> sizes_;
+    std::vector<SortedRun> runs_;
+    std::mutex mutex_;
+};
+
+class MergedCell {
+    /* k-way merge of the parts of one cell in all sorted runs: next() returns the values of the cell
+     * in ascending order, the same sequence as sorting all values in memory. Each run is read in blocks.
+     */
+  public:
+    MergedCell( const SortedRuns& runs, int cell ) : MergedCell( runs.getRuns(), cell ) {}
+
+    MergedCell( const std::vector<SortedRun>& runs, int cell ) {
+        for( auto& run : runs ) {
+            Source source;
+            source.fd = run.fd;
+            source.position = run.offsets[cell];
+            source.end = run.offsets[cell+1];
+            source.i = 0;
+            if( source.position == source.end ) continue;
+            sources_.push_back( source );
+            read( sources_.back() );
+            heap_.push( Head{ sources_.back().block[0], int( sources_.size()-1 ) } );
+        }
+    }
+
+    float next() {
+        Head head = heap_.top();
+        heap_.pop();
+        auto& source = sources_[head.source];
+        if( ++source.i == source.block.size() ) read( source );
+        if( source.i < source.block.size() ) heap_.push( Head{ source.block[source.i], head.source } );
+        return head.value;
+    }
+
+  private:
+    struct Source {
+        int fd;
+        size_t position, end; // values of the cell, which are not read yet
+        std::vector<float> block;
+        size_t i;
+    };
+    struct Head {
+        float value;
+        int source;
+        bool operator>( const Head& other ) const { return value > other.value; }
+    };
+
+    void read( Source& source ) {
+        size_t n = std::min( RUNBLOCKSIZE, source.end-source.position );
+        source.block.resize( n );
+        source.i = 0;
+        size_t bytes = n*sizeof(float);
+        char* data = (char*)source.block.data();
+        for( size_t done=0; done<bytes; ) {
+            ssize_t r = pread( source.fd, data+done, bytes-done, source.position*sizeof(float)+done );
+            if( r <= 0 ) {
+                std::cerr << "ERROR: Could not read a sorted run" << std::endl;
+                exit(1);
+            }
+            done += r;
+        }
+        source.position += n;
+    }
+
+    std::vector<Source> sources_;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heap_;
+};
+
+SortedRun SortedRuns::merge( const std::vector<SortedRun>& runs ) const {
+    // Merges the runs to one run of the next level, and closes them
+    static auto mergeTimer = getTimer( "mergeRuns" );
+    ScopedTimer timer( mergeTimer );
+    SortedRun run;
+    run.fd = createScratchFile();
+    run.level = 0;
+    for( auto& other : runs ) run.level = std::max( run.level, other.level+1 );
+    run.offsets.assign( 1, 0 );
+    std::vector<float> block;
+    block.reserve( RUNBLOCKSIZE );
+    for( int cell=0; cell<nCells_; ++cell ) {
+        size_t n = 0;
+        for( auto& other : runs ) n += other.offsets[cell+1]-other.offsets[cell];
+        MergedCell values( runs, cell );
+        for( size_t i=0; i<n; ++i ) {
+            block.push_back( values.next() );
+            if( block.size() == RUNBLOCKSIZE ) {
+                writeValues( run.fd, block.data(), block.size() );
+                block.clear();
+            }
+        }
+        run.offsets.push_back( run.offsets.back()+n );
+    }
+    writeValues( run.fd, block.data(), block.size() );
+    for( auto& other : runs ) close( other.fd );
+    addCount( "runsMerged", runs.size() );
+    return run;
+}
+
+template <class STREAM>
+class SequentialAccess {
+    /* Access to the i-th value of a stream, for indices which are at least the previous index minus one,
+     * as needed for the quantile transfer.
+     */
+  public:
+    SequentialAccess( STREAM& stream ) : stream_( stream ) {}
+
+    float at( size_t i ) {
+        for( ; next_<=i; ++next_ ) {
+            previous_ = current_;
+            current_ = stream_.next();
+        }
+        return i+1 == next_ ? current_ : previous_;
+    }
+
+  private:
+    STREAM& stream_;
+    size_t next_ = 0;
+    float current_ = 0, previous_ = 0;
+};
+
+#endif
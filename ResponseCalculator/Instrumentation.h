@@ -0,0 +1,147 @@
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include<atomic>
+#include<chrono>
+#include<cstdlib>
+#include<fstream>
+#include<iostream>
+#include<map>
+#include<memory>
+#include<mutex>
+#include<string>
+
+/* Timers and counters, which are written to a report at exit.
+ * The report is enabled by setting the environment variable RESPONSE_REPORT to the name of the
+ * output file, ending in .json or .csv. If it is not set, timers and counters only check a flag.
+ * The time of a timer is summed over all threads, so it can be larger than the wall time.
+ */
+
+struct InstrumentationRecord {
+    std::atomic<long long> calls{ 0 };
+    // Nanoseconds for timers, counts for counters
+    std::atomic<long long> value{ 0 };
+};
+
+class Instrumentation {
+  public:
+    static Instrumentation& get() {
+        static Instrumentation instance;
+        return instance;
+    }
+
+    bool enabled() const { return enabled_; }
+
+    InstrumentationRecord& timer( const std::string& name ) { return getRecord( timers_, name ); }
+    InstrumentationRecord& counter( const std::string& name ) { return getRecord( counters_, name ); }
+
+    ~Instrumentation() {
+        if( enabled_ ) writeReport();
+    }
+
+  private:
+    typedef std::map<std::string, std::unique_ptr<InstrumentationRecord>> Records;
+
+    Instrumentation() {
+        const char* filename = getenv( "RESPONSE_REPORT" );
+        if( filename && *filename ) filename_ = filename;
+        enabled_ = !filename_.empty();
+    }
+
+    InstrumentationRecord& getRecord( Records& records, const std::string& name ) {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        auto& record = records[name];
+        if( !record ) record.reset( new InstrumentationRecord );
+        return *record;
+    }
+
+    void writeReport() {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        std::ofstream file( filename_.c_str() );
+        bool json = filename_.size() < 4 || filename_.compare( filename_.size()-4, 4, ".csv" ) != 0;
+        if( json ) {
+            file << "{\n  \"timers\": {";
+            std::string separator = "\n";
+            for( auto& timer : timers_ ) {
+                file << separator << "    \"" << timer.first << "\": { \"calls\": " << timer.second->calls
+                    << ", \"seconds\": " << timer.second->value*1e-9 << " }";
+                separator = ",\n";
+            }
+            file << "\n  },\n  \"counters\": {";
+            separator = "\n";
+            for( auto& counter : counters_ ) {
+                file << separator << "    \"" << counter.first << "\": " << counter.second->value;
+                separator = ",\n";
+            }
+            file << "\n  }\n}\n";
+        } else {
+            file << "type,name,calls,value" << std::endl;
+            for( auto& timer : timers_ ) {
+                file << "timer," << timer.first << "," << timer.second->calls << "," << timer.second->value*1e-9 << std::endl;
+            }
+            for( auto& counter : counters_ ) {
+                file << "counter," << counter.first << "," << counter.second->calls << "," << counter.second->value << std::endl;
+            }
+        }
+        if( !file ) {
+            std::cerr << "ERROR: Could not write report " << filename_ << std::endl;
+        }
+    }
+
+    bool enabled_;
+    std::string filename_;
+    std::mutex mutex_;
+    Records timers_, counters_;
+};
+
+InstrumentationRecord* getTimer( const char* name ) {
+    // Returns 0 if the report is disabled. In hot paths, keep the result in a static variable.
+    auto& instrumentation = Instrumentation::get();
+    return instrumentation.enabled() ? &instrumentation.timer( name ) : 0;
+}
+
+InstrumentationRecord* getCounter( const char* name ) {
+    auto& instrumentation = Instrumentation::get();
+    return instrumentation.enabled() ? &instrumentation.counter( name ) : 0;
+}
+
+void addCount( InstrumentationRecord* counter, long long n=1 ) {
+    // In loops, sum locally and add once
+    if( !counter ) return;
+    counter->value += n;
+    counter->calls++;
+}
+
+void addCount( const char* name, long long n=1 ) {
+    addCount( getCounter( name ), n );
+}
+
+class ScopedTimer {
+    // Adds the time between construction and destruction to the timer
+  public:
+    ScopedTimer( InstrumentationRecord* timer ) :
+        record_( timer )
+    {
+        if( record_ ) start_ = std::chrono::steady_clock::now();
+    }
+
+    ScopedTimer( const char* name ) :
+        ScopedTimer( getTimer( name ) )
+    {}
+
+    ~ScopedTimer() {
+        if( !record_ ) return;
+        auto stop = std::chrono::steady_clock::now();
+        record_->value += std::chrono::duration_cast<std::chrono::nanoseconds>( stop - start_ ).count();
+        record_->calls++;
+    }
+
+    ScopedTimer( const ScopedTimer& ) = delete;
+    ScopedTimer& operator=( const ScopedTimer& ) = delete;
+
+  private:
+    InstrumentationRecord* record_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#endif
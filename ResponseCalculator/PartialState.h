@@ -0,0 +1,186 @@
+#ifndef PARTIALSTATE_H
+#define PARTIALSTATE_H
+
+#include<cstdint>
+#include<cstdlib>
+#include<cstring>
+#include<fstream>
+#include<iostream>
+#include<string>
+#include<vector>
+
+// ROOT
+#include<TAxis.h>
+#include<TH3F.h>
+
+// user incuded files
+#include "Instrumentation.h"
+#include "ResponseCube.h"
+#include "ScaleMap.h"
+
+/* Binary format of a partial state:
+ *   PartialStateHeader
+ *   float fast[nValues]   counts of all bins including under- and overflow, in the order of ResponseCube
+ *   float full[nValues]
+ * A partial state holds the counts of some input files. Partial states are merged by adding the counts,
+ * so they can be produced independently for each file and merged in any order and grouping.
+ */
+
+const char PARTIALSTATEMAGIC[8] = { 'E', 'C', 'A', 'L', 'P', 'R', 'T', '\0' };
+const uint32_t PARTIALSTATEVERSION = 1;
+
+struct PartialStateHeader {
+    char magic[8];
+    uint32_t version;
+    // Bit 0 for fastsim, bit 1 for fullsim
+    uint32_t weighted;
+    // All bins are stored, so first and last are always 0 and nBins+1
+    ScaleMapAxis axes[3];
+    // Number of fastsim and fullsim input files
+    uint64_t nFiles[2];
+    uint64_t nValues;
+};
+static_assert( sizeof(PartialStateHeader) % 8 == 0, "The values have to be aligned" );
+
+class PartialState {
+    /* Fastsim and fullsim response distributions (responseVsEVsEta) of a set of input files.
+     * The scale is calculated from the merged state, see calculateResponse.
+     */
+  public:
+    PartialState( const TH3F& h3, bool isFastsim ) :
+        fast_( isFastsim ? ResponseCube( h3 ) : ResponseCube( *h3.GetXaxis(), *h3.GetYaxis(), *h3.GetZaxis() ) ),
+        full_( isFastsim ? ResponseCube( *h3.GetXaxis(), *h3.GetYaxis(), *h3.GetZaxis() ) : ResponseCube( h3 ) )
+    {
+        for( auto axis : { h3.GetXaxis(), h3.GetYaxis(), h3.GetZaxis() } ) {
+            if( axis->IsVariableBinSize() ) {
+                std::cerr << "ERROR: Partial states only support equidistant binning" << std::endl;
+                exit(1);
+            }
+        }
+        nFiles_[0] = isFastsim;
+        nFiles_[1] = !isFastsim;
+    }
+
+    static PartialState read( const std::string& filename ) {
+        ScopedTimer timer( "readPartialState" );
+        std::ifstream file( filename.c_str(), std::ios::binary );
+        PartialStateHeader header;
+        if( !file.read( (char*)&header, sizeof(PartialStateHeader) ) ||
+                std::memcmp( header.magic, PARTIALSTATEMAGIC, sizeof(PARTIALSTATEMAGIC) ) ||
+                header.version != PARTIALSTATEVERSION ) {
+            std::cerr << "ERROR: " << filename << " is not a valid partial state" << std::endl;
+            exit(1);
+        }
+        PartialState state( header );
+        if( state.fast_.size() != header.nValues || !readCube( file, state.fast_ ) || !readCube( file, state.full_ ) ) {
+            std::cerr << "ERROR: Could not read partial state " << filename << std::endl;
+            exit(1);
+        }
+        return state;
+    }
+
+    void write( const std::string& filename ) const {
+        ScopedTimer timer( "writePartialState" );
+        PartialStateHeader header;
+        std::memset( &header, 0, sizeof(PartialStateHeader) );
+        std::memcpy( header.magic, PARTIALSTATEMAGIC, sizeof(PARTIALSTATEMAGIC) );
+        header.version = PARTIALSTATEVERSION;
+        header.weighted = fast_.isWeighted() | full_.isWeighted() << 1;
+        const TAxis* axes[3] = { &fast_.getXaxis(), &fast_.getYaxis(), &fast_.getZaxis() };
+        for( int i=0; i<3; ++i ) {
+            auto& axis = header.axes[i];
+            axis.nBins = axes[i]->GetNbins();
+            axis.first = 0;
+            axis.last = axis.nBins+1;
+            axis.min = axes[i]->GetXmin();
+            axis.max = axes[i]->GetXmax();
+        }
+        header.nFiles[0] = nFiles_[0];
+        header.nFiles[1] = nFiles_[1];
+        header.nValues = fast_.size();
+
+        std::ofstream file( filename.c_str(), std::ios::binary );
+        file.write( (const char*)&header, sizeof(PartialStateHeader) );
+        writeCube( file, fast_ );
+        writeCube( file, full_ );
+        if( !file ) {
+            std::cerr << "ERROR: Could not write partial state " << filename << std::endl;
+            exit(1);
+        }
+    }
+
+    void merge( const PartialState& other ) {
+        const TAxis* axes[3] = { &fast_.getXaxis(), &fast_.getYaxis(), &fast_.getZaxis() };
+        const TAxis* otherAxes[3] = { &other.fast_.getXaxis(), &other.fast_.getYaxis(), &other.fast_.getZaxis() };
+        for( int i=0; i<3; ++i ) {
+            if( axes[i]->GetNbins() != otherAxes[i]->GetNbins() ||
+                    axes[i]->GetXmin() != otherAxes[i]->GetXmin() ||
+                    axes[i]->GetXmax() != otherAxes[i]->GetXmax() ) {
+                std::cerr << "ERROR: Partial states with different binning can not be merged" << std::endl;
+                exit(1);
+            }
+        }
+        fast_.add( other.fast_ );
+        full_.add( other.full_ );
+        nFiles_[0] += other.nFiles_[0];
+        nFiles_[1] += other.nFiles_[1];
+    }
+
+    TH3F book( const std::string& name ) const {
+        // Empty histogram with the binning of the state, e.g. for the scale
+        const auto& x = fast_.getXaxis();
+        const auto& y = fast_.getYaxis();
+        const auto& z = fast_.getZaxis();
+        return TH3F( name.c_str(), ";E_{gen};#eta_{gen};E/E_{gen}",
+            x.GetNbins(), x.GetXmin(), x.GetXmax(),
+            y.GetNbins(), y.GetXmin(), y.GetXmax(),
+            z.GetNbins(), z.GetXmin(), z.GetXmax() );
+    }
+
+    const ResponseCube& getFastsim() const { return fast_; }
+    const ResponseCube& getFullsim() const { return full_; }
+    uint64_t getNFilesFastsim() const { return nFiles_[0]; }
+    uint64_t getNFilesFullsim() const { return nFiles_[1]; }
+
+  private:
+    PartialState( const PartialStateHeader& header ) :
+        fast_( getAxis( header.axes[0] ), getAxis( header.axes[1] ), getAxis( header.axes[2] ) ),
+        full_( getAxis( header.axes[0] ), getAxis( header.axes[1] ), getAxis( header.axes[2] ) )
+    {
+        fast_.setWeighted( header.weighted & 1 );
+        full_.setWeighted( header.weighted & 2 );
+        nFiles_[0] = header.nFiles[0];
+        nFiles_[1] = header.nFiles[1];
+    }
+
+    // The cubes are stored with all bins, but converted one x, y bin at a time
+    static bool readCube( std::istream& file, ResponseCube& cube ) {
+        std::vector<float> column( cube.getNbinsZ()+2 );
+        for( int x=0; x<cube.getNbinsX()+2; ++x ) {
+            for( int y=0; y<cube.getNbinsY()+2; ++y ) {
+                if( !file.read( (char*)column.data(), column.size()*sizeof(float) ) ) return false;
+                cube.setColumn( x, y, column.data() );
+            }
+        }
+        return true;
+    }
+
+    static void writeCube( std::ostream& file, const ResponseCube& cube ) {
+        std::vector<float> column( cube.getNbinsZ()+2 );
+        for( int x=0; x<cube.getNbinsX()+2; ++x ) {
+            for( int y=0; y<cube.getNbinsY()+2; ++y ) {
+                cube.getColumn( x, y, column.data() );
+                file.write( (const char*)column.data(), column.size()*sizeof(float) );
+            }
+        }
+    }
+
+    static TAxis getAxis( const ScaleMapAxis& axis ) {
+        return TAxis( axis.nBins, axis.min, axis.max );
+    }
+
+    ResponseCube fast_, full_;
+    uint64_t nFiles_[2];
+};
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef PLOTQUEUE_H
+#define PLOTQUEUE_H
+
+#include<condition_variable>
+#include<deque>
+#include<functional>
+#include<iostream>
+#include<mutex>
+#include<string>
+#include<thread>
+
+// ROOT
+#include<TCanvas.h>
+#include<TDirectory.h>
+#include<TPad.h>
+#include<TROOT.h>
+
+// user incuded files
+#include "Instrumentation.h"
+
+class PlotQueue {
+    /* Draws plots on a background thread, so the calculation does not have to wait for the graphics.
+     * A plot is a function, which draws on its own canvas and passes it to save(). All pages are
+     * written to one multi-page pdf, or to several files name_0.pdf, name_1.pdf, ... with at most
+     * pagesPerFile pages each. Only every sampling-th plot is drawn, and sampling=0 disables the plots.
+     * If capacity plots are already waiting, the caller is blocked until the oldest one is drawn,
+     * so the memory of the waiting plots is bounded and no plot is lost.
+     * The plots have to own the objects they draw. While the queue is running, no other thread may
+     * use ROOT graphics, so call finish() before drawing anything else.
+     */
+  public:
+    typedef std::function<void()> Plot;
+
+    PlotQueue( const std::string& filename, int sampling=1, size_t capacity=1000, int pagesPerFile=0 ) :
+        filename_( filename ),
+        sampling_( sampling ),
+        capacity_( capacity ),
+        pagesPerFile_( pagesPerFile )
+    {
+        if( sampling_ <= 0 ) return;
+        ROOT::EnableThreadSafety();
+        gROOT->SetBatch();
+        thread_ = std::thread( [this]() { run(); } );
+    }
+
+    ~PlotQueue() { finish(); }
+
+    PlotQueue( const PlotQueue& ) = delete;
+    PlotQueue& operator=( const PlotQueue& ) = delete;
+
+    void add( Plot plot ) {
+        if( sampling_ <= 0 || nAdded_++ % sampling_ ) return;
+        {
+            std::unique_lock<std::mutex> lock( mutex_ );
+            if( done_ ) {
+                std::cerr << "ERROR: Plot added after PlotQueue::finish(), it is not drawn" << std::endl;
+                return;
+            }
+            if( queue_.size() >= capacity_ ) {
+                static auto waitTimer = getTimer( "waitForPlots" );
+                ScopedTimer timer( waitTimer );
+                space_.wait( lock, [this]() { return queue_.size() < capacity_; } );
+            }
+            queue_.push_back( plot );
+        }
+        condition_.notify_one();
+    }
+
+    void save( TPad& canvas, const std::string& title ) {
+        // Writes the canvas as next page. Only to be called by the plots.
+        std::string name = getFilename( nPages_ );
+        if( name != openFile_ ) {
+            if( openFile_.size() ) canvas.Print( ( openFile_+"]" ).c_str() );
+            canvas.Print( ( name+"[" ).c_str() );
+            openFile_ = name;
+        }
+        canvas.Print( name.c_str(), ( "Title:"+title ).c_str() );
+        nPages_++;
+        addCount( "plotsDrawn" );
+    }
+
+    void finish() {
+        // Draws all waiting plots and closes the output
+        if( !thread_.joinable() ) return;
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            done_ = true;
+        }
+        condition_.notify_one();
+        thread_.join();
+    }
+
+  private:
+    std::string getFilename( int page ) const {
+        if( pagesPerFile_ <= 0 ) return filename_;
+        auto dot = filename_.rfind( '.' );
+        return filename_.substr( 0, dot ) + "_" + std::to_string( page/pagesPerFile_ ) + filename_.substr( dot );
+    }
+
+    void run() {
+        // gDirectory is thread local, so the histograms created while drawing are not added to a directory
+        gDirectory = 0;
+        while( true ) {
+            Plot plot;
+            {
+                std::unique_lock<std::mutex> lock( mutex_ );
+                condition_.wait( lock, [this]() { return done_ || !queue_.empty(); } );
+                if( queue_.empty() ) break;
+                plot = std::move( queue_.front() );
+                queue_.pop_front();
+            }
+            space_.notify_all();
+            ScopedTimer timer( "drawPlot" );
+            plot();
+        }
+        if( openFile_.size() ) {
+            // The file is closed with an empty canvas, since the canvases of the plots are already deleted
+            TCanvas canvas;
+            canvas.Print( ( openFile_+"]" ).c_str() );
+        }
+    }
+
+    std::string filename_;
+    int sampling_;
+    size_t capacity_;
+    int pagesPerFile_;
+    long nAdded_ = 0;
+    int nPages_ = 0;
+    std::string openFile_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    // Notified when a plot is taken from the queue
+    std::condition_variable space_;
+    std::deque<Plot> queue_;
+    bool done_ = false;
+    std::thread thread_;
+};
+
+#endif
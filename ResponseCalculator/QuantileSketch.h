@@ -0,0 +1,152 @@
+#ifndef QUANTILESKETCH_H
+#define QUANTILESKETCH_H
+
+#include<algorithm>
+#include<cmath>
+#include<limits>
+#include<vector>
+
+struct Centroid {
+    double mean;
+    double weight;
+};
+
+class TDigest {
+    /* Merging t-digest (T. Dunning, "Computing extremely accurate quantiles using t-digests").
+     * The distribution is summarized by at most ~2*compression centroids, which are small
+     * in the tails and large in the center. Values are collected in a buffer, which is merged
+     * into the centroids when it is full. Digests can be merged, e.g. from several files or threads.
+     * Larger compression gives better accuracy and needs more memory.
+     */
+  public:
+    TDigest( double compression=100 ) :
+        compression_( compression ),
+        total_( 0 ),
+        min_( std::numeric_limits<double>::infinity() ),
+        max_( -std::numeric_limits<double>::infinity() )
+    {}
+
+    void add( double x, double w=1 ) {
+        buffer_.push_back( Centroid{ x, w } );
+        total_ += w;
+        min_ = std::min( min_, x );
+        max_ = std::max( max_, x );
+        if( buffer_.size() >= bufferSize() ) compress();
+    }
+
+    void merge( const TDigest& other ) {
+        for( auto& c : other.centroids_ ) buffer_.push_back( c );
+        for( auto& c : other.buffer_ ) buffer_.push_back( c );
+        total_ += other.total_;
+        min_ = std::min( min_, other.min_ );
+        max_ = std::max( max_, other.max_ );
+        compress();
+    }
+
+    void compress() {
+        // Merges the buffer into the centroids
+        if( buffer_.empty() ) return;
+        buffer_.insert( buffer_.end(), centroids_.begin(), centroids_.end() );
+        std::stable_sort( buffer_.begin(), buffer_.end(),
+            []( const Centroid& a, const Centroid& b ) { return a.mean < b.mean; } );
+
+        centroids_.clear();
+        Centroid current = buffer_[0];
+        double weightSoFar = 0;
+        double kLeft = scale( 0 );
+        for( size_t i=1; i<buffer_.size(); ++i ) {
+            double proposed = current.weight + buffer_[i].weight;
+            if( scale( (weightSoFar+proposed)/total_ ) - kLeft <= 1 ) {
+                current.mean += ( buffer_[i].mean - current.mean ) * buffer_[i].weight / proposed;
+                current.weight = proposed;
+            } else {
+                weightSoFar += current.weight;
+                kLeft = scale( weightSoFar/total_ );
+                centroids_.push_back( current );
+                current = buffer_[i];
+            }
+        }
+        centroids_.push_back( current );
+        // Release the memory of the buffer
+        std::vector<Centroid>().swap( buffer_ );
+    }
+
+    double quantile( double q ) {
+        // Value below which a fraction q of the weight is
+        compress();
+        if( centroids_.empty() ) return 0;
+        if( q <= 0 ) return min_;
+        if( q >= 1 ) return max_;
+        double target = q*total_;
+        // The weight of a centroid is assumed to be centered around its mean
+        double left = 0;
+        double previousCenter = 0, previousMean = min_;
+        for( auto& c : centroids_ ) {
+            double center = left + c.weight/2;
+            if( target < center ) {
+                return interpolate( target, previousCenter, center, previousMean, c.mean );
+            }
+            previousCenter = center;
+            previousMean = c.mean;
+            left += c.weight;
+        }
+        return interpolate( target, previousCenter, total_, previousMean, max_ );
+    }
+
+    double cdf( double x ) {
+        // Fraction of the weight below x
+        compress();
+        if( centroids_.empty() || x < min_ ) return 0;
+        if( x >= max_ ) return 1;
+        double left = 0;
+        double previousCenter = 0, previousMean = min_;
+        for( auto& c : centroids_ ) {
+            double center = left + c.weight/2;
+            if( x < c.mean ) {
+                return interpolate( x, previousMean, c.mean, previousCenter, center ) / total_;
+            }
+            previousCenter = center;
+            previousMean = c.mean;
+            left += c.weight;
+        }
+        return interpolate( x, previousMean, max_, previousCenter, total_ ) / total_;
+    }
+
+    double getTotalWeight() const { return total_; }
+    double getMin() const { return min_; }
+    double getMax() const { return max_; }
+    double getCompression() const { return compression_; }
+    const std::vector<Centroid>& getCentroids() { compress(); return centroids_; }
+
+    void setState( const std::vector<Centroid>& centroids, double total, double min, double max ) {
+        // Restores a digest, e.g. from a file
+        centroids_ = centroids;
+        buffer_.clear();
+        total_ = total;
+        min_ = min;
+        max_ = max;
+    }
+
+  private:
+    size_t bufferSize() const { return 5*size_t( compression_ ); }
+
+    double scale( double q ) const {
+        // Scale function k2, which limits the size of the centroids.
+        // The centroids get very small in both tails, where the scale is most sensitive.
+        q = std::min( std::max( q, 1e-15 ), 1-1e-15 );
+        return compression_ / ( 4*log( std::max( total_/compression_, 1. ) ) + 24 ) * log( q/(1-q) );
+    }
+
+    static double interpolate( double x, double x0, double x1, double y0, double y1 ) {
+        if( x1 <= x0 ) return y1;
+        return y0 + ( x-x0 ) / ( x1-x0 ) * ( y1-y0 );
+    }
+
+    double compression_;
+    double total_;
+    double min_, max_;
+    std::vector<Centroid> centroids_;
+    std::vector<Centroid> buffer_;
+};
+
+#endif
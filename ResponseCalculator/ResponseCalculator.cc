@@ -2,6 +2,8 @@
 #include<iostream>
 #include<sstream>
 #include<string>
+#include<vector>
+#include<unistd.h> // provides getopt
 
 // ROOT
 #include<TCanvas.h>
@@ -15,6 +17,14 @@
 #include<TROOT.h>
 
 // user incuded files
+#include "CellScheduler.h"
+#include "ChebyshevScale.h"
+#include "Instrumentation.h"
+#include "PartialState.h"
+#include "ScaleAlgorithms.h"
+#include "ScaleCalculation.h"
+#include "ScaleMap.h"
+#include "ShardedCalculation.h"
 #include "Style.h"
 
 using namespace std;
@@ -22,6 +32,7 @@ using namespace std;
 template <class HIST>
 HIST getHist( std::string const & filename, std::string const & histname ) {
     // Reads a histogram from a file
+    ScopedTimer timer( "readHist" );
 
     TFile file( filename.c_str() );
     if( file.IsZombie() ) {
@@ -43,165 +54,6 @@ HIST getHist( std::string const & filename, std::string const & histname ) {
     return hist;
 }
 
-TGraphAsymmErrors modifyScale( const TGraphAsymmErrors& origScale, double mean ) {
-    // Resplaces the points with too large uncertainty with the mean and removes all uncertainties.
-    // This is done to prevent statistical fluctuations.
-
-    auto modScale = (TGraphAsymmErrors*) origScale.Clone();
-
-    for( auto i=0; i<modScale->GetN(); i++) {
-        double x, y;
-        modScale->GetPoint(i, x, y );
-        double errorUp = modScale->GetErrorYhigh(i);
-        double errorDn = modScale->GetErrorYlow(i);
-        if(
-            (errorUp+errorDn)/2 > std::max( 0.05, std::abs( mean - 1 ) )// uncertainty larger than correction
-        ) {
-            modScale->SetPoint( i, x, mean );
-        }
-
-        // The uncertainties will not be used and are therefore set to 0
-        modScale->SetPointEYhigh( i, 0 );
-        modScale->SetPointEYlow ( i, 0 );
-    }
-    return *modScale;
-}
-
-
-TH1D getSimplifiedScale( const TH1D& h1_fast, const TH1D& h1_full ) {
-    auto h1_scale = *((TH1D*)h1_fast.Clone());
-
-    float intFast = h1_fast.Integral();
-    float intFull = h1_full.Integral();
-
-    for( auto binFast=h1_fast.GetNbinsX()+1; binFast>0; binFast-- ) {
-        auto fastInt = h1_fast.Integral( binFast, -1 )/intFast;
-        int binFull;
-        for( binFull=h1_fast.GetNbinsX()+1; binFull>0; binFull-- ) {
-            auto fullInt = h1_full.Integral( binFull, -1 )/intFull;
-            if( fullInt > fastInt ) break;
-        }
-        h1_scale.SetBinContent( binFast, h1_fast.GetXaxis()->GetBinCenter(binFull)/h1_fast.GetXaxis()->GetBinCenter(binFast) );
-
-    }
-
-
-
-    return h1_scale;
-}
-
-TGraphAsymmErrors getScaleWithUncertainties( const TH1D& h1_fast, const TH1D& h1_full ) {
-    /* For each fastsim energy, calculate the are from -inf to the energy.
-     * Search then the fullsim energy, which corresponds to the same area.
-     * The statistical uncertanity of fullsim, fastsim and the binning uncertainty is taken into account.
-     */
-
-    // This object will be returned
-    TGraphAsymmErrors out = TGraphAsymmErrors();
-    // The x-title will be inherited from the input histo, the y-title is newly set
-    out.SetTitle( (std::string(";")+h1_fast.GetXaxis()->GetTitle()+";Scale    ").c_str() );
-
-    // Unweighted histograms are assumed
-    // A cast to int is done, to bypass numerical (un)precission
-    if( round(h1_fast.GetEntries()) != round(h1_fast.GetEffectiveEntries()) ||
-            round(h1_full.GetEntries()) != round(h1_full.GetEffectiveEntries()) ) {
-        std::cerr << "Please provide unweighted histograms" << std::endl;
-        return out;
-    }
-
-    // Calculate confidence level ( approx 0.683 )
-    double alpha = TMath::Erf( 1./TMath::Sqrt2() );
-
-    // Used for calculating uncertainties
-    TEfficiency eff = TEfficiency();
-
-    int entriesFast = h1_fast.GetEntries();
-    int entriesFull = h1_full.GetEntries();
-
-    int nBinsFast = h1_fast.GetNbinsX()+2;
-    int nBinsFull = h1_fast.GetNbinsX()+2;
-
-    // To improve acess time, the entries of h1_full will be saved as vector
-    std::vector<int> cumulativeFull;
-    cumulativeFull.reserve( nBinsFull );
-    cumulativeFull.push_back( int(h1_full.GetBinContent(0)) );
-    for( int i=1; i<nBinsFull; ++i ) {
-        cumulativeFull.push_back( cumulativeFull.back() + int(h1_full.GetBinContent(i)) );
-    }
-
-    int summedEntriesFast = 0;
-    for( int binFast=1; binFast<nBinsFast; ++binFast ) {
-        summedEntriesFast += h1_fast.GetBinContent( binFast );
-        //double areaFast = summedEntriesFast/entriesFast; // not needed, since the mean is calculated as (up+down)/2
-
-        // Take into account the statistical precission of h1
-        double areaFastUp = eff.ClopperPearson( entriesFast, summedEntriesFast, alpha, true );
-        double areaFastDn = eff.ClopperPearson( entriesFast, summedEntriesFast, alpha, false );
-
-        // Number of entries in the fullsim corresponding to these bondaries
-        int entriesFull_StatFastDn = floor( areaFastDn * entriesFull );
-        int entriesFull_StatFastUp = ceil ( areaFastUp * entriesFull );
-
-
-        // Find the bins in hFull, which corresponds to the same area from hFast
-        // This is the propagation of the statistical uncertainty of hFast to hFull
-        int binFull_StatFastDn = -1;
-        int binFull_StatFastUp = -1;
-        for( int binFull=nBinsFull-1; 0<=binFull; --binFull ) {
-            if( cumulativeFull.at(binFull) >= entriesFull_StatFastDn ) {
-                binFull_StatFastDn = binFull;
-            }
-        }
-        for( int binFull=0; binFull<nBinsFull-1; ++binFull ) {
-            if( cumulativeFull.at(binFull) <= entriesFull_StatFastUp ) {
-                binFull_StatFastUp = binFull;
-            }
-        }
-
-        // Take the middle. This is somehow arbitrary, but feel free to envolve a better method
-        int binFullMiddle = (binFull_StatFastUp + binFull_StatFastDn)/2;
-
-        // Compute the statistical precission of hFull
-        double areaFullUp = eff.ClopperPearson( entriesFull, cumulativeFull.at(binFullMiddle), alpha, true );
-        double areaFullDn = eff.ClopperPearson( entriesFull, cumulativeFull.at(binFullMiddle), alpha, false );
-
-        // Number of entries in the fullsim corresponding to these bondaries
-        int entriesFull_StatFullDn = floor( areaFullDn * entriesFull );
-        int entriesFull_StatFullUp = ceil ( areaFullUp * entriesFull );
-        int binFull_StatFullDn = -1;
-        int binFull_StatFullUp = -1;
-        for( int binFull=nBinsFull-1; 0<=binFull; --binFull ) {
-            if( cumulativeFull.at(binFull) >= entriesFull_StatFullDn ) {
-                binFull_StatFullDn = binFull;
-            }
-        }
-        for( int binFull=0; binFull<nBinsFull-1; ++binFull ) {
-            if( cumulativeFull.at(binFull) <= entriesFull_StatFullUp ) {
-                binFull_StatFullUp = binFull;
-            }
-        }
-
-        // Calculate the scale
-        double efull = h1_fast.GetBinCenter( binFullMiddle );
-        double efast = h1_fast.GetBinCenter( binFast );
-        double scale = efull / efast;
-
-        // add binning uncertanity, assuming equidistant binning
-        double binningUncertSquared = pow( h1_fast.GetBinWidth(1), 2 ) / 12; // assume uniform distribution
-        binningUncertSquared = 0; // binning uncertainty are taken into account by including/excluding the border-bins
-
-        // now combine binning uncertainty, and stat h1 and stat h2
-        double errorUp = sqrt( pow(h1_fast.GetBinCenter( binFull_StatFastUp )-efull, 2 ) + pow(h1_fast.GetBinCenter( binFull_StatFullUp )-efull, 2 ) + binningUncertSquared ) / efast;
-        double errorDn = sqrt( pow(h1_fast.GetBinCenter( binFull_StatFastDn )-efull, 2 ) + pow(h1_fast.GetBinCenter( binFull_StatFullDn )-efull, 2 ) + binningUncertSquared ) / efast;
-
-        out.SetPoint( binFast, efast, scale );
-        out.SetPointError( binFast, 0, 0, errorDn, errorUp );
-    }
-
-    return out;
-
-}
-
 TH1F graphToHisto( const TGraph& gr ) {
     auto h = gr.GetHistogram();
     h->Reset( "ICESM" );
@@ -261,6 +113,7 @@ void applyScale( TH1D h1_fast, TH1D h1_full, const TGraphAsymmErrors& scale, con
 
 void drawAll( TH1D h1_fast, TH1D h1_full, TGraphAsymmErrors scale, TGraphAsymmErrors corrScale, const std::string& savename ) {
     // The inputs are cloned, so we can modify them
+    ScopedTimer timer( "drawAll" );
 
 
     // "Closure test"
@@ -323,55 +176,6 @@ std::string getBinLabel( const TH3F& h3, int xbin, int ybin ) {
 
 }
 
-TH3F calculateResponse( const TH3F& h3_fast, const TH3F& h3_full ) {
-
-    // This is the output histogram
-    auto h3_scale = *((TH3F*)h3_fast.Clone("responseVsEVsEta"));
-    h3_scale.Reset();
-
-    // For each E_gen, eta_gen bin, extract the one dimensional E_sim/E_gen histogram
-    for( int xbin=1; xbin< h3_fast.GetNbinsX()+1; ++xbin ) { // E_gen
-        for( int ybin=1; ybin< h3_fast.GetNbinsY()+1; ++ybin ) { // eta_gen
-
-            auto name = getBinLabel( h3_fast, xbin, ybin );
-
-            // Create the 1d histograms
-            auto h1_fast = h3_fast.ProjectionZ( "fast", xbin, xbin, ybin, ybin );
-            auto h1_full = h3_full.ProjectionZ( "full", xbin, xbin, ybin, ybin );
-
-            if( !h1_fast->GetEntries() || !h1_full->GetEntries() ) continue;
-
-            name += ";E_{sim}/E_{true}; Normalized Entries  ";
-            h1_fast->SetTitle( name.c_str() );
-            h1_full->SetTitle( name.c_str() );
-
-/*
-            auto h1_scale = getSimplifiedScale( *h1_fast, *h1_full );
-            for( int i=1;i<h1_scale.GetNbinsX()+1;i++){
-                h3_scale.SetBinContent( xbin, ybin, i, h1_scale.GetBinContent(i) );
-            }
-*/
-
-            auto scale = getScaleWithUncertainties( *h1_fast, *h1_full );
-            auto corrScale = modifyScale( scale, h1_full->GetMean()/h1_fast->GetMean() );
-
-            // Push back the scale into the output histogram
-            for( auto i=0; i<corrScale.GetN(); i++) {
-                double x,y;
-                corrScale.GetPoint(i,x,y);
-                // i+1 corresponds to the z-bin
-                h3_scale.SetBinContent( xbin, ybin, i+1, y );
-            }
-
-            std::string savename = std::to_string(xbin) + "and" + std::to_string(ybin);
-//            drawAll( (TH1D)(*h1_fast), (TH1D)(*h1_full), scale, corrScale, savename );
-        }
-    return h3_scale;// only first e bin
-    }
-
-    return h3_scale;
-}
-
 TH2D drawMeanResponse( const TH3F& h3_fast, const TH3F& h3_full ) {
     // Analysis function. The result of this function is NOT used for scaling,
     // but for analysis purpose only. The mean scale (E_sim/E_gen) is plotted
@@ -428,39 +232,141 @@ TH3F meanResponseAsH3( const TH3F& h3_fast, const TH3F& h3_full ) {
     return h3_scale;
 }
 
+bool isPartialState( const std::string& filename ) {
+    const std::string suffix = ".partial";
+    return filename.size() > suffix.size() && filename.compare( filename.size()-suffix.size(), suffix.size(), suffix ) == 0;
+}
+
 int main( int argc, char** argv ) {
     setStyle();
-
-    if ( argc < 3 ) {
-        std::cerr << "Usage: " << argv[0] << " fastsim.root fullsim.root" << std::endl;
+    ScopedTimer timer( "total" );
+
+    unsigned nThreads = 0; // all cores
+    std::string partialType; // "fast" or "full": write the partial state of the input files
+    std::string outputname; // partial state which is written
+    bool simplified = false; // quantile matching without uncertainties, see getSimplifiedScale
+    int nProcesses = 0; // if > 1, the scale is calculated by this many worker processes
+    bool writeFile = false; // write the scale to scaleECALFastsim.root and scaleECALFastsim.scalemap
+    int opt;
+    while( ( opt = getopt( argc, argv, "j:s:o:Sb:a:m:c:p:r:w" ) ) != -1 ) {
+        switch( opt ) {
+            case 'j': nThreads = std::stoi( optarg ); break;
+            case 's': partialType = optarg; break;
+            case 'o': outputname = optarg; break;
+            case 'S': simplified = true; break;
+            case 'b': BOOTSTRAPREPLICAS = std::stoi( optarg ); break;
+            case 'a': ADAPTIVEENTRIES = std::stoi( optarg ); break;
+            case 'm': MERGEETAENTRIES = std::stoi( optarg ); break;
+            case 'c': CHEBYSHEVTOLERANCE = std::stof( optarg ); break;
+            case 'p': nProcesses = std::stoi( optarg ); break;
+            case 'r': RESULTCACHEDIR = optarg; break;
+            case 'w': writeFile = true; break;
+            default: return 1;
+        }
+    }
+    std::vector<std::string> inputs( argv+optind, argv+argc );
+
+    bool partialInput = !inputs.empty() && isPartialState( inputs[0] );
+    if( ( partialType.size() && ( partialType != "fast" && partialType != "full" ) ) ||
+        ( ( partialType.size() || partialInput ) ? inputs.empty() : inputs.size() < 2 ) ||
+        ( partialType.size() && outputname.empty() ) ) {
+        std::cerr << "Usage: " << argv[0] << " [-j nThreads] [-p nProcesses] [-r directory] [-w] [-S] [-b nReplicas] [-a entries] [-m entries] [-c tolerance] fastsim.root fullsim.root" << std::endl;
+        std::cerr << "       " << argv[0] << " [-a entries] -s fast|full -o output.partial input.root [...]" << std::endl;
+        std::cerr << "       " << argv[0] << " -o output.partial input.partial [...]" << std::endl;
+        std::cerr << "       " << argv[0] << " [-j nThreads] [-p nProcesses] [-r directory] [-w] [-S] [-b nReplicas] [-a entries] [-m entries] [-c tolerance] input.partial [...]" << std::endl;
+        std::cerr << "The first form calculates the scale from two files. The others split this into steps:" << std::endl;
+        std::cerr << "the histogram of each input file is stored as partial state, partial states are merged," << std::endl;
+        std::cerr << "and the scale is calculated from the merged partial states." << std::endl;
+        std::cerr << "With -w, the scale is written to scaleECALFastsim.root and as table to scaleECALFastsim.scalemap." << std::endl;
+        std::cerr << "With -S, the simplified scale without uncertainties is calculated." << std::endl;
+        std::cerr << "With -b, the uncertainties are estimated from nReplicas bootstrap replicas, and are written" << std::endl;
+        std::cerr << "to scaleECALFastsim.root." << std::endl;
+        std::cerr << "With -a, the E/E_gen bins of each E_gen, eta_gen bin are merged to bins with at least" << std::endl;
+        std::cerr << "this many entries, instead of merging each 10 bins. With -m, neighbouring eta_gen bins" << std::endl;
+        std::cerr << "are merged until they have at least this many entries." << std::endl;
+        std::cerr << "With -c, the scale is also written as Chebyshev series to scaleECALFastsim.scalecheb, which" << std::endl;
+        std::cerr << "deviate at most by tolerance." << std::endl;
+        std::cerr << "With -p, the E_gen, eta_gen bins are distributed to this many local worker processes," << std::endl;
+        std::cerr << "which share the nThreads cores." << std::endl;
+        std::cerr << "With -r, the result of each E_gen, eta_gen bin is stored in this directory, and reused" << std::endl;
+        std::cerr << "in the next calculation if its histograms and the options did not change." << std::endl;
         return 1;
     }
-    std::string filenameFast = argv[1];
-    std::string filenameFull = argv[2];
 
-    // This histogram should be avaiable in both input files
+    // This histogram should be avaiable in all input files
     std::string histname = "ecalScaleFactorCalculator/responseVsEVsEta";
 
+    auto readInput = [&]( const std::string& filename ) {
+        auto h3 = getHist<TH3F>( filename, histname );
+        // e_gen, eta_gen, response. With adaptive binning, the response is merged per E_gen, eta_gen bin.
+        h3.Rebin3D( 1, 100, ADAPTIVEENTRIES > 0 ? 1 : 10 );
+        return h3;
+    };
+
+    TH3F h;
+    // Bootstrap uncertainties of the scale, if enabled
+    TH3F hErrorDn, hErrorUp;
+    TH3F* errorDn = BOOTSTRAPREPLICAS > 0 ? &hErrorDn : 0;
+    TH3F* errorUp = BOOTSTRAPREPLICAS > 0 ? &hErrorUp : 0;
+
+    if( partialType.size() ) {
+        // Partial state of the input files
+        PartialState state( readInput( inputs[0] ), partialType == "fast" );
+        for( unsigned i=1; i<inputs.size(); ++i ) {
+            state.merge( PartialState( readInput( inputs[i] ), partialType == "fast" ) );
+        }
+        state.write( outputname );
+        return 0;
+    } else if( partialInput ) {
+        // Merge the partial states, and write the result or calculate the scale
+        auto state = PartialState::read( inputs[0] );
+        for( unsigned i=1; i<inputs.size(); ++i ) {
+            state.merge( PartialState::read( inputs[i] ) );
+        }
+        if( outputname.size() ) {
+            state.write( outputname );
+            return 0;
+        }
+        std::cout << "Calculate scale from " << state.getNFilesFastsim() << " fastsim and "
+            << state.getNFilesFullsim() << " fullsim files" << std::endl;
+        hErrorDn = state.book( "responseVsEVsEta_errorDn" );
+        hErrorUp = state.book( "responseVsEVsEta_errorUp" );
+        if( simplified ) {
+            h = getSimplifiedScale( state.getFastsim(), state.getFullsim(), state.book( "responseVsEVsEta" ), nThreads );
+        } else if( nProcesses > 1 ) {
+            h = calculateResponseSharded( state.getFastsim(), state.getFullsim(), state.book( "responseVsEVsEta" ), nProcesses, nThreads, errorDn, errorUp );
+        } else {
+            h = calculateResponse( state.getFastsim(), state.getFullsim(), state.book( "responseVsEVsEta" ), nThreads, errorDn, errorUp );
+        }
+    } else {
+        auto h3_fast = readInput( inputs[0] );
+        auto h3_full = readInput( inputs[1] );
+
+//        auto h = meanResponseAsH3( h3_fast, h3_full );
+        if( simplified ) {
+            h = getSimplifiedScale( h3_fast, h3_full, nThreads );
+        } else if( nProcesses > 1 ) {
+            h = calculateResponseSharded( h3_fast, h3_full, nProcesses, nThreads, errorDn, errorUp );
+        } else {
+            h = calculateResponse( h3_fast, h3_full, nThreads, errorDn, errorUp );
+        }
+    }
 
-    auto h3_fast = getHist<TH3F>( filenameFast, histname );
-    auto h3_full = getHist<TH3F>( filenameFull, histname );
-
-
-    // e_gen, eta_gen, response
-    h3_fast.Rebin3D( 1, 100, 10 );
-    h3_full.Rebin3D( 1, 100, 10 );
-
-
-//    auto h = meanResponseAsH3( h3_fast, h3_full );
-    auto h = calculateResponse( h3_fast, h3_full );
-
-    bool writeFile = false;
-
-    if( writeFile ) {
+    // The bootstrap uncertainties and the Chebyshev series are only available in the files
+    if( writeFile || ( BOOTSTRAPREPLICAS > 0 && !simplified ) || CHEBYSHEVTOLERANCE > 0 ) {
+        ScopedTimer writeTimer( "writeFile" );
         TFile file( "scaleECALFastsim.root", "recreate" );
         file.cd();
         h.Write();
+        if( errorDn && !simplified ) {
+            hErrorDn.Write();
+            hErrorUp.Write();
+        }
         file.Close();
+        // Compact copy, which can be memory mapped by the consumers
+        writeScaleMap( h, "scaleECALFastsim.scalemap" );
+        // Few coefficients per E_gen, eta_gen bin instead of the table
+        if( CHEBYSHEVTOLERANCE > 0 ) writeChebyshevScale( h, "scaleECALFastsim.scalecheb", CHEBYSHEVTOLERANCE, nThreads );
     }
 }
 
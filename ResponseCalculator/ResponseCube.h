@@ -0,0 +1,253 @@
+#ifndef RESPONSECUBE_H
+#define RESPONSECUBE_H
+
+#include<algorithm>
+#include<cmath>
+#include<string>
+#include<vector>
+
+// ROOT
+#include<TAxis.h>
+#include<TH1D.h>
+#include<TH3F.h>
+
+// user incuded files
+#include "Instrumentation.h"
+
+struct ZColumn {
+    /* Non-owning view on the response distribution of one E_gen, eta_gen bin.
+     * The bins are indexed including the under- (0) and overflow (size-1) bin, so the indices are the same
+     * as for the bins of a projection on the z-axis. Only the bins [first,first+nValues) are stored
+     * contiguously, all other bins are empty.
+     */
+    const float* data;
+    int size;
+    int first;
+    int nValues;
+
+    ZColumn( const float* values, int nBins, int firstBin=0, int nStored=-1 ) :
+        data( values ),
+        size( nBins ),
+        first( firstBin ),
+        nValues( nStored < 0 ? nBins : nStored )
+    {}
+
+    float operator[]( int bin ) const {
+        unsigned i = bin-first;
+        return i < unsigned(nValues) ? data[i] : 0;
+    }
+    int last() const { return first+nValues; }
+
+    double entries() const {
+        // For unweighted histograms, the sum of all bins including under- and overflow
+        double sum = 0;
+        for( int i=0; i<nValues; ++i ) sum += data[i];
+        return round( sum );
+    }
+
+    double mean( const TAxis& axis ) const {
+        // Like TH1::GetMean of a projection: under- and overflow are not used
+        double sumw = 0, sumwx = 0;
+        for( int bin=std::max( first, 1 ); bin<std::min( last(), size-1 ); ++bin ) {
+            sumw  += data[bin-first];
+            sumwx += data[bin-first] * axis.GetBinCenter( bin );
+        }
+        return sumw ? sumwx/sumw : 0;
+    }
+};
+
+TH1D columnToHist( const ZColumn& column, const TAxis& axis, const std::string& name ) {
+    // Creates a histogram from the column, e.g. for drawing. The histogram is not added to gDirectory.
+    bool addDirectory = TH1::AddDirectoryStatus();
+    TH1::AddDirectory( false );
+    TH1D h = axis.IsVariableBinSize() ?
+        TH1D( name.c_str(), "", axis.GetNbins(), axis.GetXbins()->GetArray() ) :
+        TH1D( name.c_str(), "", axis.GetNbins(), axis.GetXmin(), axis.GetXmax() );
+    TH1::AddDirectory( addDirectory );
+    h.GetXaxis()->SetTitle( axis.GetTitle() );
+    for( int bin=0; bin<column.size; ++bin ) {
+        h.SetBinContent( bin, column[bin] );
+    }
+    h.SetEntries( column.entries() );
+    return h;
+}
+
+class ResponseCube {
+    /* Response distributions E_sim/E_gen for each E_gen (x) and eta_gen (y) bin.
+     * In contrast to TH3F, the z-axis is the fastest running index, so the distribution
+     * of each x, y bin is contiguous in memory and can be accessed without a projection.
+     * Only the band from the first to the last non-empty z-bin of each x, y bin is stored,
+     * since the response populates a narrow range and many x, y bins are empty.
+     */
+  public:
+    ResponseCube( const TAxis& xAxis, const TAxis& yAxis, const TAxis& zAxis ) :
+        xAxis_( xAxis ),
+        yAxis_( yAxis ),
+        zAxis_( zAxis ),
+        nX_( xAxis.GetNbins()+2 ),
+        nY_( yAxis.GetNbins()+2 ),
+        nZ_( zAxis.GetNbins()+2 ),
+        weighted_( false ),
+        bands_( size_t(nX_)*nY_ )
+    {}
+
+    ResponseCube( const TH3F& h3 ) :
+        ResponseCube( *h3.GetXaxis(), *h3.GetYaxis(), *h3.GetZaxis() )
+    {
+        // The TH3F array is read sequentially (x is its fastest running index) in two passes:
+        // the first finds the band of each x, y bin, the second copies the content
+        ScopedTimer timer( "buildCube" );
+        const float* array = h3.GetArray();
+        const double* sumw2 = h3.GetSumw2N() ? h3.GetSumw2()->GetArray() : 0;
+        std::vector<int> first( bands_.size(), nZ_ ), last( bands_.size(), 0 );
+        size_t bin = 0;
+        for( int z=0; z<nZ_; ++z ) {
+            for( int y=0; y<nY_; ++y ) {
+                for( int x=0; x<nX_; ++x, ++bin ) {
+                    if( !array[bin] ) continue;
+                    size_t cell = size_t(x)*nY_ + y;
+                    first[cell] = std::min( first[cell], z );
+                    last[cell] = z+1;
+                    if( sumw2 && sumw2[bin] != array[bin] ) weighted_ = true;
+                }
+            }
+        }
+        for( size_t cell=0; cell<bands_.size(); ++cell ) {
+            if( first[cell] >= last[cell] ) continue;
+            bands_[cell].first = first[cell];
+            bands_[cell].values.resize( last[cell]-first[cell] );
+        }
+        bin = 0;
+        for( int z=0; z<nZ_; ++z ) {
+            for( int y=0; y<nY_; ++y ) {
+                for( int x=0; x<nX_; ++x, ++bin ) {
+                    if( array[bin] ) bands_[size_t(x)*nY_ + y].values[z-first[size_t(x)*nY_ + y]] = array[bin];
+                }
+            }
+        }
+    }
+
+    void fill( double x, double y, double z, double w=1 ) {
+        auto& band = bands_[size_t( xAxis_.FindFixBin( x ) )*nY_ + yAxis_.FindFixBin( y )];
+        int zbin = zAxis_.FindFixBin( z );
+        extend( band, zbin, zbin+1 );
+        band.values[zbin-band.first] += w;
+        if( w != 1 ) weighted_ = true;
+    }
+
+    void add( const ResponseCube& other ) {
+        // Both cubes must have the same binning
+        for( size_t cell=0; cell<bands_.size(); ++cell ) {
+            const auto& otherBand = other.bands_[cell];
+            if( otherBand.values.empty() ) continue;
+            auto& band = bands_[cell];
+            extend( band, otherBand.first, otherBand.first+otherBand.values.size() );
+            for( size_t i=0; i<otherBand.values.size(); ++i ) {
+                band.values[otherBand.first-band.first+i] += otherBand.values[i];
+            }
+        }
+        weighted_ = weighted_ || other.weighted_;
+    }
+
+    void addTo( TH3F& h3 ) const {
+        /* Adds the content to the histogram, which must have the same binning, as if each entry was filled
+         * with weight 1. The statistics of the histogram are recalculated from its bins.
+         * Only the stored bands are visited, in the order of the TH3F array (x is its fastest running index).
+         */
+        ScopedTimer timer( "cubeToHist" );
+        float* array = h3.GetArray();
+        double* sumw2 = h3.GetSumw2N() ? h3.GetSumw2()->fArray : 0;
+        double entries = h3.GetEntries();
+        for( int x=0; x<nX_; ++x ) {
+            for( int y=0; y<nY_; ++y ) {
+                const auto& band = bands_[index( x, y )];
+                for( size_t i=0; i<band.values.size(); ++i ) {
+                    size_t bin = ( size_t( band.first+i )*nY_ + y )*nX_ + x;
+                    array[bin] += band.values[i];
+                    if( sumw2 ) sumw2[bin] += band.values[i];
+                    entries += band.values[i];
+                }
+            }
+        }
+        h3.ResetStats();
+        h3.SetEntries( entries );
+    }
+
+    ZColumn column( int xbin, int ybin ) const {
+        const auto& band = bands_[index( xbin, ybin )];
+        return ZColumn( band.values.data(), nZ_, band.first, band.values.size() );
+    }
+
+    float getBinContent( int xbin, int ybin, int zbin ) const { return column( xbin, ybin )[zbin]; }
+
+    void getColumn( int xbin, int ybin, float* values ) const {
+        // Copies all z-bins of the x, y bin, including the empty ones
+        auto c = column( xbin, ybin );
+        for( int bin=0; bin<nZ_; ++bin ) values[bin] = c[bin];
+    }
+
+    void setColumn( int xbin, int ybin, const float* values ) {
+        // Replaces all z-bins of the x, y bin. Only the band of non-empty bins is kept.
+        auto& band = bands_[index( xbin, ybin )];
+        int first = 0, last = nZ_;
+        while( first < last && !values[first] ) ++first;
+        while( last > first && !values[last-1] ) --last;
+        band.first = first;
+        band.values.assign( values+first, values+last );
+    }
+
+    int getNbinsX() const { return nX_-2; }
+    int getNbinsY() const { return nY_-2; }
+    int getNbinsZ() const { return nZ_-2; }
+    const TAxis& getXaxis() const { return xAxis_; }
+    const TAxis& getYaxis() const { return yAxis_; }
+    const TAxis& getZaxis() const { return zAxis_; }
+
+    // Unweighted histograms are assumed by the scale calculation
+    bool isWeighted() const { return weighted_; }
+    void setWeighted( bool weighted ) { weighted_ = weighted; }
+
+    // Number of bins including under- and overflow, and the number of stored bins
+    size_t size() const { return size_t(nX_)*nY_*nZ_; }
+    size_t storedSize() const {
+        size_t n = 0;
+        for( const auto& band : bands_ ) n += band.values.size();
+        return n;
+    }
+
+  private:
+    struct Band {
+        int first = 0;
+        std::vector<float> values;
+    };
+
+    size_t index( int xbin, int ybin ) const {
+        return size_t(xbin)*nY_ + ybin;
+    }
+
+    static void extend( Band& band, int first, int last ) {
+        // Makes the band cover the z-bins [first,last)
+        if( band.values.empty() ) {
+            band.first = first;
+            band.values.assign( last-first, 0 );
+            return;
+        }
+        if( first < band.first ) {
+            band.values.insert( band.values.begin(), band.first-first, 0 );
+            band.first = first;
+        }
+        if( last > band.first+int(band.values.size()) ) band.values.resize( last-band.first, 0 );
+    }
+
+    TAxis xAxis_, yAxis_, zAxis_;
+    int nX_, nY_, nZ_;
+    bool weighted_;
+    std::vector<Band> bands_;
+};
+
+void mergePartial( ResponseCube& result, const ResponseCube& partial ) {
+    // Used by fillParallel
+    result.add( partial );
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include<cerrno>
+#include<cmath>
+#include<cstdint>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<fstream>
+#include<initializer_list>
+#include<iostream>
+#include<string>
+#include<vector>
+
+// files
+#include<sys/stat.h>
+#include<unistd.h>
+
+// ROOT
+#include<TAxis.h>
+#include<TGraphAsymmErrors.h>
+
+// user incuded files
+#include "AdaptiveBinning.h"
+#include "Bootstrap.h"
+#include "CounterRandom.h"
+#include "ResponseCube.h"
+
+// If not empty, the result of each group of E_gen, eta_gen bins is stored in this directory, keyed by
+// the hash of its inputs. A later calculation reuses the results, and only calculates the changed groups.
+std::string RESULTCACHEDIR = "";
+
+// Part of the key, has to be increased if the calculation of the scale changes
+const uint64_t RESULTCACHEVERSION = 2;
+
+struct CellResult {
+    // Result of the scale calculation of one E_gen, eta_gen bin, or of a group of eta_gen bins
+    bool filled = false;
+    TGraphAsymmErrors scale;
+    TGraphAsymmErrors corrScale;
+    // For adaptive binning, the first z-bin of each merged bin, see AdaptiveColumns
+    std::vector<int> firstBins;
+};
+
+void writeResult( std::ostream& file, const CellResult& result ) {
+    /* The filled flag, and for filled results the corrected scale, its lower and upper uncertainty,
+     * and the first bins of adaptive binning. These are the parts, which are used by fillGroup.
+     */
+    int32_t filled = result.filled;
+    file.write( (const char*)&filled, sizeof(filled) );
+    if( !filled ) return;
+    int32_t n = result.corrScale.GetN();
+    file.write( (const char*)&n, sizeof(n) );
+    for( int i=0; i<n; ++i ) {
+        double x, y;
+        result.corrScale.GetPoint( i, x, y );
+        double values[3] = { y, result.scale.GetErrorYlow(i), result.scale.GetErrorYhigh(i) };
+        file.write( (const char*)values, sizeof(values) );
+    }
+    int32_t nFirstBins = result.firstBins.size();
+    file.write( (const char*)&nFirstBins, sizeof(nFirstBins) );
+    file.write( (const char*)result.firstBins.data(), nFirstBins*sizeof(int) );
+}
+
+bool readResult( std::istream& file, CellResult& result ) {
+    // Restores a result written by writeResult. Returns false if the file is too short.
+    int32_t filled = 0;
+    file.read( (char*)&filled, sizeof(filled) );
+    result.filled = filled;
+    if( !file || !filled ) return bool(file);
+    int32_t n = 0;
+    file.read( (char*)&n, sizeof(n) );
+    if( !file || n < 0 ) return false;
+    result.corrScale = TGraphAsymmErrors( n );
+    result.scale = TGraphAsymmErrors( n );
+    for( int point=0; point<n; ++point ) {
+        double values[3] = {};
+        file.read( (char*)values, sizeof(values) );
+        result.corrScale.SetPoint( point, 0, values[0] );
+        result.scale.SetPointError( point, 0, 0, values[1], values[2] );
+    }
+    int32_t nFirstBins = 0;
+    file.read( (char*)&nFirstBins, sizeof(nFirstBins) );
+    if( !file || nFirstBins < 0 ) return false;
+    result.firstBins.resize( nFirstBins );
+    file.read( (char*)result.firstBins.data(), nFirstBins*sizeof(int) );
+    return bool(file);
+}
+
+uint64_t hashValue( uint64_t hash, uint64_t value ) {
+    return mix64( hash ^ value );
+}
+
+uint64_t hashValue( uint64_t hash, double value ) {
+    uint64_t bits;
+    std::memcpy( &bits, &value, sizeof(bits) );
+    return hashValue( hash, bits );
+}
+
+uint64_t hashGroup( const ResponseCube& fast, const ResponseCube& full, const EtaGroup& group ) {
+    /* Key of the result of the group: the bins and z-columns of the group in fastsim and fullsim, the z-axis
+     * and the parameters of the calculation. The bins are part of the key, since the bootstrap replicas
+     * depend on them. The empty bins outside of the stored band of a column are not hashed, but its position.
+     */
+    uint64_t hash = streamKey( RESULTCACHEVERSION, group.x, group.firstY, group.lastY );
+    hash = hashValue( hash, uint64_t( int64_t( BOOTSTRAPREPLICAS ) ) );
+    hash = hashValue( hash, uint64_t( BOOTSTRAPSEED ) );
+    hash = hashValue( hash, uint64_t( int64_t( ADAPTIVEENTRIES ) ) );
+    hash = hashValue( hash, uint64_t( int64_t( MERGEETAENTRIES ) ) );
+
+    const TAxis& axis = fast.getZaxis();
+    hash = hashValue( hash, uint64_t( axis.GetNbins() ) );
+    for( int bin=1; bin<=axis.GetNbins()+1; ++bin ) hash = hashValue( hash, axis.GetBinLowEdge( bin ) );
+
+    for( const ResponseCube* cube : { &fast, &full } ) {
+        for( int y=group.firstY; y<=group.lastY; ++y ) {
+            auto column = cube->column( group.x, y );
+            hash = hashValue( hash, uint64_t( column.first ) );
+            hash = hashValue( hash, uint64_t( column.nValues ) );
+            for( int i=0; i<column.nValues; ++i ) {
+                uint32_t bits;
+                std::memcpy( &bits, &column.data[i], sizeof(bits) );
+                hash = hashValue( hash, uint64_t( bits ) );
+            }
+        }
+    }
+    return hash;
+}
+
+void openResultCache() {
+    // Creates RESULTCACHEDIR, if it does not exist
+    if( mkdir( RESULTCACHEDIR.c_str(), 0755 ) != 0 && errno != EEXIST ) {
+        std::cerr << "ERROR: Could not create the result cache " << RESULTCACHEDIR << std::endl;
+        exit(1);
+    }
+}
+
+std::string getResultName( uint64_t key ) {
+    char name[32];
+    snprintf( name, sizeof(name), "/%016llx.cell", (unsigned long long)key );
+    return RESULTCACHEDIR + name;
+}
+
+bool hasCachedResult( uint64_t key ) {
+    return access( getResultName( key ).c_str(), R_OK ) == 0;
+}
+
+bool readCachedResult( uint64_t key, CellResult& result ) {
+    // A missing or incomplete file is not an error, the result is calculated again
+    std::ifstream file( getResultName( key ).c_str(), std::ios::binary );
+    if( file && readResult( file, result ) ) return true;
+    result = CellResult();
+    return false;
+}
+
+void writeCachedResult( uint64_t key, const CellResult& result ) {
+    // The result is written to a temporary file and renamed, so other processes never read a partial file.
+    // A result, which can not be written, is only missing in the next calculation.
+    std::string filename = getResultName( key );
+    std::string temporary = filename + "." + std::to_string( getpid() );
+    {
+        std::ofstream file( temporary.c_str(), std::ios::binary );
+        writeResult( file, result );
+        if( !file ) {
+            std::cerr << "WARNING: Could not write " << temporary << " to the result cache" << std::endl;
+            std::remove( temporary.c_str() );
+            return;
+        }
+    }
+    std::rename( temporary.c_str(), filename.c_str() );
+}
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef SCALEALGORITHMS_H
+#define SCALEALGORITHMS_H
+
+#include<algorithm>
+#include<cmath>
+#include<iostream>
+#include<string>
+#include<vector>
+
+// ROOT
+#include<TGraphAsymmErrors.h>
+#include<TH1D.h>
+#include<TMath.h>
+
+// user incuded files
+#include "ClopperPearson.h"
+#include "Instrumentation.h"
+#include "ResponseCube.h"
+
+int findFirstBinAbove( const std::vector<int>& cumulative, int entries ) {
+    // Returns the first bin with at least 'entries' cumulative entries, or -1 if there is none.
+    // Since the cumulative distribution is monotonic, a binary search can be used.
+    auto it = std::lower_bound( cumulative.begin(), cumulative.end(), entries );
+    return it == cumulative.end() ? -1 : it - cumulative.begin();
+}
+
+int findLastBinBelow( const std::vector<int>& cumulative, int entries ) {
+    // Returns the last bin with at most 'entries' cumulative entries, or -1 if there is none.
+    // The last (overflow) bin is never returned.
+    if( cumulative.empty() ) return -1;
+    auto it = std::upper_bound( cumulative.begin(), cumulative.end()-1, entries );
+    return ( it - cumulative.begin() ) - 1;
+}
+
+TGraphAsymmErrors modifyScale( const TGraphAsymmErrors& origScale, double mean ) {
+    // Resplaces the points with too large uncertainty with the mean and removes all uncertainties.
+    // This is done to prevent statistical fluctuations.
+
+    auto modScale = (TGraphAsymmErrors*) origScale.Clone();
+
+    static auto replacedCounter = getCounter( "pointsReplacedByMean" );
+    int nReplaced = 0;
+    for( auto i=0; i<modScale->GetN(); i++) {
+        double x, y;
+        modScale->GetPoint(i, x, y );
+        double errorUp = modScale->GetErrorYhigh(i);
+        double errorDn = modScale->GetErrorYlow(i);
+        if(
+            (errorUp+errorDn)/2 > std::max( 0.05, std::abs( mean - 1 ) )// uncertainty larger than correction
+        ) {
+            modScale->SetPoint( i, x, mean );
+            nReplaced++;
+        }
+
+        // The uncertainties will not be used and are therefore set to 0
+        modScale->SetPointEYhigh( i, 0 );
+        modScale->SetPointEYlow ( i, 0 );
+    }
+    addCount( replacedCounter, nReplaced );
+    return *modScale;
+}
+
+
+TH1D getSimplifiedScale( const TH1D& h1_fast, const TH1D& h1_full ) {
+    auto h1_scale = *((TH1D*)h1_fast.Clone());
+
+    float intFast = h1_fast.Integral();
+    float intFull = h1_full.Integral();
+
+    for( auto binFast=h1_fast.GetNbinsX()+1; binFast>0; binFast-- ) {
+        auto fastInt = h1_fast.Integral( binFast, -1 )/intFast;
+        int binFull;
+        for( binFull=h1_fast.GetNbinsX()+1; binFull>0; binFull-- ) {
+            auto fullInt = h1_full.Integral( binFull, -1 )/intFull;
+            if( fullInt > fastInt ) break;
+        }
+        h1_scale.SetBinContent( binFast, h1_fast.GetXaxis()->GetBinCenter(binFull)/h1_fast.GetXaxis()->GetBinCenter(binFast) );
+
+    }
+
+
+
+    return h1_scale;
+}
+
+TGraphAsymmErrors getScaleWithUncertainties( const ZColumn& fast, const ZColumn& full, const TAxis& axis ) {
+    /* For each fastsim energy, calculate the are from -inf to the energy.
+     * Search then the fullsim energy, which corresponds to the same area.
+     * The statistical uncertanity of fullsim, fastsim and the binning uncertainty is taken into account.
+     * The distributions have to be unweighted and binned in axis, including under- and overflow.
+     */
+    static auto scaleTimer = getTimer( "getScaleWithUncertainties" );
+    ScopedTimer timer( scaleTimer );
+
+    // This object will be returned
+    TGraphAsymmErrors out = TGraphAsymmErrors();
+    // The x-title will be inherited from the input histo, the y-title is newly set
+    out.SetTitle( (std::string(";")+axis.GetTitle()+";Scale    ").c_str() );
+
+    // Calculate confidence level ( approx 0.683 )
+    double alpha = TMath::Erf( 1./TMath::Sqrt2() );
+
+    // Used for calculating uncertainties
+    auto& clopperPearson = getClopperPearsonCache( alpha );
+
+    int entriesFast = fast.entries();
+    int entriesFull = full.entries();
+
+    int nBinsFast = fast.size;
+    int nBinsFull = fast.size;
+
+    // To improve acess time, the cumulative fullsim entries will be saved as vector
+    std::vector<int> cumulativeFull;
+    cumulativeFull.reserve( nBinsFull );
+    cumulativeFull.push_back( int(full[0]) );
+    for( int i=1; i<nBinsFull; ++i ) {
+        cumulativeFull.push_back( cumulativeFull.back() + int(full[i]) );
+    }
+
+    // The fastsim intervals only depend on the fastsim distribution, so they are evaluated in one batch
+    std::vector<int> cumulativeFast;
+    cumulativeFast.reserve( nBinsFast );
+    int summedEntriesFast = 0;
+    for( int binFast=1; binFast<nBinsFast; ++binFast ) {
+        summedEntriesFast += double( fast[binFast] );
+        cumulativeFast.push_back( summedEntriesFast );
+    }
+    std::vector<double> areasFastDn, areasFastUp;
+    static auto clopperPearsonTimer = getTimer( "clopperPearson" );
+    {
+        ScopedTimer intervalTimer( clopperPearsonTimer );
+        clopperPearson.intervals( entriesFast, cumulativeFast, areasFastDn, areasFastUp );
+    }
+
+    for( int binFast=1; binFast<nBinsFast; ++binFast ) {
+        //double areaFast = summedEntriesFast/entriesFast; // not needed, since the mean is calculated as (up+down)/2
+
+        // Take into account the statistical precission of h1
+        double areaFastUp = areasFastUp[binFast-1];
+        double areaFastDn = areasFastDn[binFast-1];
+
+        // Number of entries in the fullsim corresponding to these bondaries
+        int entriesFull_StatFastDn = floor( areaFastDn * entriesFull );
+        int entriesFull_StatFastUp = ceil ( areaFastUp * entriesFull );
+
+
+        // Find the bins in hFull, which corresponds to the same area from hFast
+        // This is the propagation of the statistical uncertainty of hFast to hFull
+        int binFull_StatFastDn = findFirstBinAbove( cumulativeFull, entriesFull_StatFastDn );
+        int binFull_StatFastUp = findLastBinBelow( cumulativeFull, entriesFull_StatFastUp );
+
+        // Take the middle. This is somehow arbitrary, but feel free to envolve a better method
+        int binFullMiddle = (binFull_StatFastUp + binFull_StatFastDn)/2;
+
+        // Compute the statistical precission of hFull
+        double areaFullUp = clopperPearson.upper( entriesFull, cumulativeFull.at(binFullMiddle) );
+        double areaFullDn = clopperPearson.lower( entriesFull, cumulativeFull.at(binFullMiddle) );
+
+        // Number of entries in the fullsim corresponding to these bondaries
+        int entriesFull_StatFullDn = floor( areaFullDn * entriesFull );
+        int entriesFull_StatFullUp = ceil ( areaFullUp * entriesFull );
+        int binFull_StatFullDn = findFirstBinAbove( cumulativeFull, entriesFull_StatFullDn );
+        int binFull_StatFullUp = findLastBinBelow( cumulativeFull, entriesFull_StatFullUp );
+
+        // Calculate the scale
+        double efull = axis.GetBinCenter( binFullMiddle );
+        double efast = axis.GetBinCenter( binFast );
+        double scale = efull / efast;
+
+        // add binning uncertanity, assuming equidistant binning
+        double binningUncertSquared = pow( axis.GetBinWidth(1), 2 ) / 12; // assume uniform distribution
+        binningUncertSquared = 0; // binning uncertainty are taken into account by including/excluding the border-bins
+
+        // now combine binning uncertainty, and stat h1 and stat h2
+        double errorUp = sqrt( pow(axis.GetBinCenter( binFull_StatFastUp )-efull, 2 ) + pow(axis.GetBinCenter( binFull_StatFullUp )-efull, 2 ) + binningUncertSquared ) / efast;
+        double errorDn = sqrt( pow(axis.GetBinCenter( binFull_StatFastDn )-efull, 2 ) + pow(axis.GetBinCenter( binFull_StatFullDn )-efull, 2 ) + binningUncertSquared ) / efast;
+
+        out.SetPoint( binFast, efast, scale );
+        out.SetPointError( binFast, 0, 0, errorDn, errorUp );
+    }
+
+    return out;
+
+}
+
+TGraphAsymmErrors getScaleWithUncertainties( const TH1D& h1_fast, const TH1D& h1_full ) {
+
+    // Unweighted histograms are assumed
+    // A cast to int is done, to bypass numerical (un)precission
+    if( round(h1_fast.GetEntries()) != round(h1_fast.GetEffectiveEntries()) ||
+            round(h1_full.GetEntries()) != round(h1_full.GetEffectiveEntries()) ) {
+        std::cerr << "Please provide unweighted histograms" << std::endl;
+        TGraphAsymmErrors out = TGraphAsymmErrors();
+        out.SetTitle( (std::string(";")+h1_fast.GetXaxis()->GetTitle()+";Scale    ").c_str() );
+        return out;
+    }
+
+    std::vector<float> fast, full;
+    for( int bin=0; bin<h1_fast.GetNbinsX()+2; ++bin ) {
+        fast.push_back( h1_fast.GetBinContent( bin ) );
+        full.push_back( h1_full.GetBinContent( bin ) );
+    }
+    return getScaleWithUncertainties( ZColumn{ fast.data(), int(fast.size()) },
+        ZColumn{ full.data(), int(full.size()) }, *h1_fast.GetXaxis() );
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef SCALECALCULATION_H
+#define SCALECALCULATION_H
+
+#include<algorithm>
+#include<functional>
+#include<iostream>
+#include<string>
+#include<vector>
+
+// ROOT
+#include<TGraphAsymmErrors.h>
+#include<TH3F.h>
+#include<TROOT.h>
+
+// user incuded files
+#include "AdaptiveBinning.h"
+#include "Bootstrap.h"
+#include "CellScheduler.h"
+#include "Instrumentation.h"
+#include "ResponseCube.h"
+#include "ResultCache.h"
+#include "ScaleAlgorithms.h"
+
+CellResult calculateGroup( const ResponseCube& fast, const ResponseCube& full, const EtaGroup& group ) {
+    // Scale of one group of E_gen, eta_gen bins, see calculateResponse
+    int cell = ( group.x-1 )*fast.getNbinsY() + group.firstY-1;
+    const TAxis& axis = fast.getZaxis();
+    CellResult result;
+
+    // A single eta_gen bin is used directly, otherwise the bins of the group are summed
+    std::vector<float> sum_fast, sum_full;
+    auto column_fast = fast.column( group.x, group.firstY );
+    auto column_full = full.column( group.x, group.firstY );
+    if( group.lastY > group.firstY ) {
+        sum_fast = sumColumns( fast, group );
+        sum_full = sumColumns( full, group );
+        column_fast = ZColumn( sum_fast.data(), sum_fast.size() );
+        column_full = ZColumn( sum_full.data(), sum_full.size() );
+    }
+
+    if( !column_fast.entries() || !column_full.entries() ) return result;
+
+    double mean = column_full.mean( axis )/column_fast.mean( axis );
+    if( ADAPTIVEENTRIES > 0 ) {
+        AdaptiveColumns merged( column_fast, column_full, axis, ADAPTIVEENTRIES );
+        result.scale = getScaleWithUncertainties( merged.fast(), merged.full(), merged.axis() );
+        if( BOOTSTRAPREPLICAS > 0 ) setBootstrapUncertainties( result.scale, merged.fast(), merged.full(), merged.axis(), cell );
+        result.firstBins = merged.getFirstBins();
+    } else {
+        result.scale = getScaleWithUncertainties( column_fast, column_full, axis );
+        if( BOOTSTRAPREPLICAS > 0 ) setBootstrapUncertainties( result.scale, column_fast, column_full, axis, cell );
+    }
+    result.corrScale = modifyScale( result.scale, mean );
+    result.filled = true;
+    return result;
+}
+
+CellResult calculateGroupCached( const ResponseCube& fast, const ResponseCube& full, const EtaGroup& group ) {
+    // Same as calculateGroup, but reuses the result in RESULTCACHEDIR, if the inputs of the group did not change
+    if( RESULTCACHEDIR.empty() ) return calculateGroup( fast, full, group );
+    uint64_t key = hashGroup( fast, full, group );
+    CellResult result;
+    if( readCachedResult( key, result ) ) {
+        addCount( "cellsCached", 1 );
+        return result;
+    }
+    result = calculateGroup( fast, full, group );
+    writeCachedResult( key, result );
+    return result;
+}
+
+void fillGroup( const EtaGroup& group, const CellResult& result, TH3F& h3_scale, TH3F* h3_errorDn=0, TH3F* h3_errorUp=0 ) {
+    // Writes the scale of the group into all its E_gen, eta_gen bins of the output histograms
+    if( !result.filled ) return;
+    int xbin = group.x; // E_gen
+    for( int ybin=group.firstY; ybin<=group.lastY; ++ybin ) { // eta_gen
+        // Push back the scale into the output histogram
+        for( auto i=0; i<result.corrScale.GetN(); i++) {
+            double x,y;
+            result.corrScale.GetPoint(i,x,y);
+            // Point i is the scale of z-bin i, see getScaleWithUncertainties. For adaptive binning, i is the
+            // merged z-bin, which contains the z-bins firstBins[i] to firstBins[i+1]-1
+            int firstBin = i, lastBin = i;
+            if( result.firstBins.size() ) {
+                if( i+1 >= int(result.firstBins.size()) ) break;
+                firstBin = result.firstBins[i];
+                lastBin = result.firstBins[i+1]-1;
+            }
+            for( int zbin=firstBin; zbin<=lastBin; ++zbin ) {
+                h3_scale.SetBinContent( xbin, ybin, zbin, y );
+                if( BOOTSTRAPREPLICAS <= 0 ) continue;
+                double errorDn = result.scale.GetErrorYlow(i);
+                double errorUp = result.scale.GetErrorYhigh(i);
+                h3_scale.SetBinError( xbin, ybin, zbin, ( errorDn+errorUp )/2 );
+                if( h3_errorDn ) h3_errorDn->SetBinContent( xbin, ybin, zbin, errorDn );
+                if( h3_errorUp ) h3_errorUp->SetBinContent( xbin, ybin, zbin, errorUp );
+            }
+        }
+    }
+}
+
+// Called for each filled group after its scale is written to the output, serially and in the order of the bins
+typedef std::function<void(const EtaGroup&,const CellResult&)> GroupCallback;
+
+TH3F calculateResponse( const ResponseCube& fast, const ResponseCube& full, TH3F h3_scale, unsigned nThreads=0,
+        TH3F* h3_errorDn=0, TH3F* h3_errorUp=0, const GroupCallback& onGroup=nullptr ) {
+    /* h3_scale is the output histogram, which is filled with the scale.
+     * With BOOTSTRAPREPLICAS > 0, the uncertainties are estimated by the bootstrap. They are filled in
+     * h3_errorDn and h3_errorUp if given, and their mean is the error of h3_scale.
+     * With MERGEETAENTRIES > 0, eta_gen bins with few entries share the scale of their group, and with
+     * ADAPTIVEENTRIES > 0, the scale is calculated in merged z-bins and is constant within each of them.
+     * With RESULTCACHEDIR, only the groups with changed inputs are calculated, see calculateGroupCached.
+     */
+    ScopedTimer timer( "calculateResponse" );
+
+    // Each group of E_gen, eta_gen bins is independent, so they are processed in parallel.
+    // The results are merged afterwards in the order of the bins, to get the same output as a serial run.
+    auto groups = getEtaGroups( fast, full, MERGEETAENTRIES );
+    std::vector<CellResult> results( groups.size() );
+
+    if( fast.isWeighted() || full.isWeighted() ) {
+        std::cerr << "Please provide unweighted histograms" << std::endl;
+        return h3_scale;
+    }
+
+    ROOT::EnableThreadSafety();
+    if( RESULTCACHEDIR.size() ) openResultCache();
+
+    runCells( groups.size(), nThreads, [&]( int iGroup ) {
+        results[iGroup] = calculateGroupCached( fast, full, groups[iGroup] );
+    }
+    );
+
+    int nFilled = 0;
+    for( const auto& result : results ) nFilled += result.filled;
+    addCount( "cellsProcessed", nFilled );
+    addCount( "cellsSkippedEmpty", results.size()-nFilled );
+
+    for( unsigned iGroup=0; iGroup<groups.size(); ++iGroup ) {
+        fillGroup( groups[iGroup], results[iGroup], h3_scale, h3_errorDn, h3_errorUp );
+        if( onGroup && results[iGroup].filled ) onGroup( groups[iGroup], results[iGroup] );
+    }
+
+    return h3_scale;
+}
+
+const int SIMPLIFIEDBLOCKSIZE = 16;
+
+void getSimplifiedScale( const std::vector<ZColumn>& fast, const std::vector<ZColumn>& full, const TAxis& axis, std::vector<std::vector<double>>& scales ) {
+    /* Same as getSimplifiedScale for histograms, for a block of E_gen, eta_gen bins at once.
+     * The block is copied to dense arrays with the z-bin as outer and the E_gen, eta_gen bin as inner index,
+     * so all bins of the block are processed in lock-step by branchless loops over contiguous memory:
+     * The integrals from each bin to the overflow are summed in one pass over the z-bins. Since these
+     * integrals grow with decreasing bin for fastsim and fullsim, the matching is a merge of the two
+     * sequences, in which each step moves either the fastsim or the fullsim bin of each bin down.
+     * All bins take the same 2*nZ steps, the finished ones stay at bin 0. scales[i] is filled for the
+     * bins 1 to nBins+1.
+     */
+    int nCells = fast.size();
+    int nZ = axis.GetNbins()+2;
+
+    // tail[z*nCells+i] is the integral of the i-th bin of the block from z to the overflow
+    std::vector<double> tailFast( size_t(nZ+1)*nCells, 0 ), tailFull( size_t(nZ+1)*nCells, 0 );
+    std::vector<float> denseFast( size_t(nZ)*nCells, 0 ), denseFull( size_t(nZ)*nCells, 0 );
+    for( int i=0; i<nCells; ++i ) {
+        for( int z=0; z<fast[i].nValues; ++z ) denseFast[size_t(fast[i].first+z)*nCells+i] = fast[i].data[z];
+        for( int z=0; z<full[i].nValues; ++z ) denseFull[size_t(full[i].first+z)*nCells+i] = full[i].data[z];
+    }
+    for( int z=nZ-1; z>0; --z ) {
+        const double* fastAbove = &tailFast[size_t(z+1)*nCells];
+        const double* fullAbove = &tailFull[size_t(z+1)*nCells];
+        const float* fastBin = &denseFast[size_t(z)*nCells];
+        const float* fullBin = &denseFull[size_t(z)*nCells];
+        double* fastTail = &tailFast[size_t(z)*nCells];
+        double* fullTail = &tailFull[size_t(z)*nCells];
+        for( int i=0; i<nCells; ++i ) {
+            fastTail[i] = fastAbove[i] + fastBin[i];
+            fullTail[i] = fullAbove[i] + fullBin[i];
+        }
+    }
+
+    // Without under- and overflow, as TH1::Integral()
+    std::vector<float> intFast( nCells ), intFull( nCells );
+    for( int i=0; i<nCells; ++i ) {
+        intFast[i] = tailFast[nCells+i] - denseFast[size_t(nZ-1)*nCells+i];
+        intFull[i] = tailFull[nCells+i] - denseFull[size_t(nZ-1)*nCells+i];
+    }
+
+    // matched[z*nCells+i] is the fullsim bin, which matches the fastsim bin z
+    std::vector<int> binFast( nCells, nZ-1 ), binFull( nCells, nZ-1 ), matched( size_t(nZ)*nCells, 0 );
+    for( int step=0; step<2*nZ; ++step ) {
+        for( int i=0; i<nCells; ++i ) {
+            int bFast = binFast[i], bFull = binFull[i];
+            double fastInt = tailFast[size_t(bFast)*nCells+i]/intFast[i];
+            bool moveFull = bFast > 0 && bFull > 0 && !( tailFull[size_t(bFull)*nCells+i]/intFull[i] > fastInt );
+            // The last value written for a fastsim bin is the one, at which the fullsim bin stopped
+            matched[size_t(bFast)*nCells+i] = bFull;
+            binFull[i] = bFull - moveFull;
+            binFast[i] = bFast - ( bFast > 0 && !moveFull );
+        }
+    }
+
+    std::vector<double> centers( nZ );
+    for( int z=0; z<nZ; ++z ) centers[z] = axis.GetBinCenter( z );
+    for( int i=0; i<nCells; ++i ) {
+        scales[i].assign( nZ, 0 );
+        for( int z=1; z<nZ; ++z ) scales[i][z] = centers[matched[size_t(z)*nCells+i]]/centers[z];
+    }
+}
+
+TH3F getSimplifiedScale( const ResponseCube& fast, const ResponseCube& full, TH3F h3_scale, unsigned nThreads=0 ) {
+    // Alternative to calculateResponse: the quantile matching of getSimplifiedScale, without uncertainties
+    ScopedTimer timer( "getSimplifiedScale" );
+
+    int nBinsX = fast.getNbinsX();
+    int nBinsY = fast.getNbinsY();
+    int nCells = nBinsX*nBinsY;
+    const TAxis& axis = fast.getZaxis();
+
+    // Empty for the bins without fastsim or fullsim events
+    std::vector<std::vector<double>> scales( nCells );
+
+    int nBlocks = ( nCells + SIMPLIFIEDBLOCKSIZE-1 )/SIMPLIFIEDBLOCKSIZE;
+    runCells( nBlocks, nThreads, [&]( int block ) {
+        std::vector<int> cells;
+        std::vector<ZColumn> columns_fast, columns_full;
+        for( int cell=block*SIMPLIFIEDBLOCKSIZE; cell<std::min( nCells, (block+1)*SIMPLIFIEDBLOCKSIZE ); ++cell ) {
+            auto column_fast = fast.column( cell / nBinsY + 1, cell % nBinsY + 1 );
+            auto column_full = full.column( cell / nBinsY + 1, cell % nBinsY + 1 );
+            if( !column_fast.entries() || !column_full.entries() ) continue;
+            cells.push_back( cell );
+            columns_fast.push_back( column_fast );
+            columns_full.push_back( column_full );
+        }
+        if( cells.empty() ) return;
+
+        std::vector<std::vector<double>> blockScales( cells.size() );
+        getSimplifiedScale( columns_fast, columns_full, axis, blockScales );
+        for( unsigned i=0; i<cells.size(); ++i ) scales[cells[i]] = std::move( blockScales[i] );
+    }
+    );
+    int nFilled = 0;
+    for( const auto& scale : scales ) nFilled += !scale.empty();
+    addCount( "cellsProcessed", nFilled );
+    addCount( "cellsSkippedEmpty", scales.size()-nFilled );
+
+    for( int xbin=1; xbin< nBinsX+1; ++xbin ) { // E_gen
+        for( int ybin=1; ybin< nBinsY+1; ++ybin ) { // eta_gen
+            const auto& scale = scales[(xbin-1)*nBinsY + ybin-1];
+            for( unsigned i=1; i<scale.size(); i++ ) {
+                h3_scale.SetBinContent( xbin, ybin, i, scale[i] );
+            }
+        }
+    }
+
+    return h3_scale;
+}
+
+TH3F getSimplifiedScale( const TH3F& h3_fast, const TH3F& h3_full, unsigned nThreads=0 ) {
+    auto h3_scale = *((TH3F*)h3_fast.Clone("responseVsEVsEta"));
+    h3_scale.Reset();
+    return getSimplifiedScale( ResponseCube( h3_fast ), ResponseCube( h3_full ), h3_scale, nThreads );
+}
+
+TH3F bookScale( const TH3F& h3_fast, TH3F* h3_errorDn=0, TH3F* h3_errorUp=0 ) {
+    // This is the output histogram
+    auto h3_scale = *((TH3F*)h3_fast.Clone("responseVsEVsEta"));
+    h3_scale.Reset();
+    // The bootstrap uncertainties have the same binning
+    if( h3_errorDn ) *h3_errorDn = *((TH3F*)h3_scale.Clone("responseVsEVsEta_errorDn"));
+    if( h3_errorUp ) *h3_errorUp = *((TH3F*)h3_scale.Clone("responseVsEVsEta_errorUp"));
+    return h3_scale;
+}
+
+TH3F calculateResponse( const TH3F& h3_fast, const TH3F& h3_full, unsigned nThreads=0,
+        TH3F* h3_errorDn=0, TH3F* h3_errorUp=0 ) {
+
+    auto h3_scale = bookScale( h3_fast, h3_errorDn, h3_errorUp );
+
+    // Copy the inputs once, so each E_gen, eta_gen bin can be accessed without a projection
+    ResponseCube fast( h3_fast );
+    ResponseCube full( h3_full );
+    return calculateResponse( fast, full, h3_scale, nThreads, h3_errorDn, h3_errorUp );
+}
+
+#endif
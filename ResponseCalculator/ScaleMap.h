@@ -0,0 +1,335 @@
+#ifndef SCALEMAP_H
+#define SCALEMAP_H
+
+#include<algorithm>
+#include<cstdint>
+#include<cstdlib>
+#include<cstring>
+#include<fstream>
+#include<functional>
+#include<iostream>
+#include<string>
+#include<vector>
+
+// memory mapping
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+// ROOT
+#include<TAxis.h>
+#include<TH3F.h>
+
+// user incuded files
+#include "Instrumentation.h"
+
+/* Binary format of the scale map:
+ *   ScaleMapHeader
+ *   float values[nValues]   only the populated box of bins, z is the fastest running index
+ *   float errors[nValues]   only if the errors flag is set
+ * The header is 8 byte aligned, so the arrays can be used directly from a memory mapped file.
+ */
+
+const char SCALEMAPMAGIC[8] = { 'E', 'C', 'A', 'L', 'S', 'C', 'L', '\0' };
+const uint32_t SCALEMAPVERSION = 1;
+
+// Number of events for which the bins are computed at once in ScaleMap::getScales
+const size_t LOOKUPBLOCKSIZE = 256;
+
+struct ScaleMapAxis {
+    // Equidistant binning, with bins 0 (underflow) to nBins+1 (overflow) like TAxis
+    int32_t nBins;
+    // Range of bins with non-zero content, all other bins are zero
+    int32_t first, last;
+    int32_t padding;
+    double min, max;
+
+    int findBin( double x ) const {
+        // Same as TAxis::FindFixBin
+        if( x < min ) return 0;
+        if( !( x < max ) ) return nBins+1;
+        return 1 + int( nBins*(x-min)/(max-min) );
+    }
+    int size() const { return last < first ? 0 : last-first+1; }
+};
+
+struct ScaleMapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t hasErrors;
+    ScaleMapAxis axes[3];
+    uint64_t nValues;
+};
+static_assert( sizeof(ScaleMapHeader) % 8 == 0, "The values have to be aligned" );
+
+class ScaleMap {
+    /* Scale as function of E_gen, eta_gen and E_sim/E_gen, as stored in responseVsEVsEta.
+     * The map is either read from a file, which is memory mapped read-only so several processes
+     * share the same pages, or copied from a TH3F.
+     */
+  public:
+    ScaleMap( const TH3F& h3, bool withErrors=false ) {
+        initHeader( h3, withErrors );
+        owned_.resize( ( header_.hasErrors ? 2 : 1 )*header_.nValues );
+        const auto* ax = header_.axes;
+        size_t i = 0;
+        for( int x=ax[0].first; x<=ax[0].last; ++x ) {
+            for( int y=ax[1].first; y<=ax[1].last; ++y ) {
+                for( int z=ax[2].first; z<=ax[2].last; ++z, ++i ) {
+                    owned_[i] = h3.GetBinContent( x, y, z );
+                    if( header_.hasErrors ) owned_[header_.nValues+i] = h3.GetBinError( x, y, z );
+                }
+            }
+        }
+        values_ = owned_.data();
+        errors_ = header_.hasErrors ? values_+header_.nValues : 0;
+    }
+
+    ScaleMap( const std::string& filename ) {
+        int fd = open( filename.c_str(), O_RDONLY );
+        struct stat info;
+        if( fd < 0 || fstat( fd, &info ) != 0 || size_t(info.st_size) < sizeof(ScaleMapHeader) ) {
+            std::cerr << "ERROR: Could not open scale map " << filename << std::endl;
+            exit(1);
+        }
+        mappedSize_ = info.st_size;
+        mapped_ = mmap( 0, mappedSize_, PROT_READ, MAP_SHARED, fd, 0 );
+        close( fd );
+        if( mapped_ == MAP_FAILED ) {
+            std::cerr << "ERROR: Could not map scale map " << filename << std::endl;
+            exit(1);
+        }
+        std::memcpy( &header_, mapped_, sizeof(ScaleMapHeader) );
+        size_t expectedSize = sizeof(ScaleMapHeader) + ( header_.hasErrors ? 2 : 1 )*header_.nValues*sizeof(float);
+        if( std::memcmp( header_.magic, SCALEMAPMAGIC, sizeof(SCALEMAPMAGIC) ) ||
+                header_.version != SCALEMAPVERSION || mappedSize_ != expectedSize ) {
+            std::cerr << "ERROR: " << filename << " is not a valid scale map" << std::endl;
+            exit(1);
+        }
+        values_ = (const float*)( (const char*)mapped_ + sizeof(ScaleMapHeader) );
+        errors_ = header_.hasErrors ? values_+header_.nValues : 0;
+    }
+
+    ~ScaleMap() {
+        if( mapped_ ) munmap( mapped_, mappedSize_ );
+    }
+
+    ScaleMap( const ScaleMap& ) = delete;
+    ScaleMap& operator=( const ScaleMap& ) = delete;
+
+    float getBinContent( int xbin, int ybin, int zbin ) const {
+        long i = index( xbin, ybin, zbin );
+        return i < 0 ? 0 : values_[i];
+    }
+
+    float getBinError( int xbin, int ybin, int zbin ) const {
+        long i = index( xbin, ybin, zbin );
+        return i < 0 || !errors_ ? 0 : errors_[i];
+    }
+
+    float getScale( double e, double eta, double r ) const {
+        // Same as h3.GetBinContent( h3.FindFixBin( e, eta, r ) )
+        return getBinContent( header_.axes[0].findBin( e ), header_.axes[1].findBin( eta ), header_.axes[2].findBin( r ) );
+    }
+
+    void getScales( const float* e, const float* eta, const float* r, size_t n,
+            float* scales, float* errors=0, bool interpolate=false ) const {
+        /* Batch version of getScale for n events. If errors is given, the errors are filled as well.
+         * With interpolate, the scale is interpolated trilinearly between the bin centers, instead of
+         * using the step function of the bins. Empty bins are not used for the interpolation.
+         */
+        const float* inputs[3] = { e, eta, r };
+        int bins[3][LOOKUPBLOCKSIZE];
+        for( size_t start=0; start<n; start+=LOOKUPBLOCKSIZE ) {
+            size_t m = std::min<size_t>( LOOKUPBLOCKSIZE, n-start );
+            if( interpolate ) {
+                for( size_t i=0; i<m; ++i ) {
+                    interpolateScale( e[start+i], eta[start+i], r[start+i], scales[start+i], errors ? &errors[start+i] : 0 );
+                }
+                continue;
+            }
+            for( int axis=0; axis<3; ++axis ) {
+                findBins( header_.axes[axis], inputs[axis]+start, m, bins[axis] );
+            }
+            for( size_t i=0; i<m; ++i ) {
+                long bin = index( bins[0][i], bins[1][i], bins[2][i] );
+                scales[start+i] = bin < 0 ? 0 : values_[bin];
+                if( errors ) errors[start+i] = bin < 0 || !errors_ ? 0 : errors_[bin];
+            }
+        }
+    }
+
+    const ScaleMapAxis& getAxis( int i ) const { return header_.axes[i]; }
+    bool hasErrors() const { return errors_; }
+
+    void write( const std::string& filename ) const {
+        ScopedTimer timer( "writeScaleMap" );
+        std::ofstream file( filename.c_str(), std::ios::binary );
+        file.write( (const char*)&header_, sizeof(ScaleMapHeader) );
+        file.write( (const char*)values_, header_.nValues*sizeof(float) );
+        if( errors_ ) file.write( (const char*)errors_, header_.nValues*sizeof(float) );
+        if( !file ) {
+            std::cerr << "ERROR: Could not write scale map " << filename << std::endl;
+            exit(1);
+        }
+    }
+
+  private:
+    void initHeader( const TH3F& h3, bool withErrors ) {
+        std::memset( &header_, 0, sizeof(ScaleMapHeader) );
+        std::memcpy( header_.magic, SCALEMAPMAGIC, sizeof(SCALEMAPMAGIC) );
+        header_.version = SCALEMAPVERSION;
+        header_.hasErrors = withErrors;
+
+        const TAxis* axes[3] = { h3.GetXaxis(), h3.GetYaxis(), h3.GetZaxis() };
+        for( int i=0; i<3; ++i ) {
+            if( axes[i]->IsVariableBinSize() ) {
+                std::cerr << "ERROR: Scale maps only support equidistant binning" << std::endl;
+                exit(1);
+            }
+            auto& axis = header_.axes[i];
+            axis.nBins = axes[i]->GetNbins();
+            axis.min = axes[i]->GetXmin();
+            axis.max = axes[i]->GetXmax();
+            axis.first = axis.nBins+1;
+            axis.last = 0;
+        }
+
+        // Find the box containing all non-zero bins
+        auto* ax = header_.axes;
+        for( int x=0; x<ax[0].nBins+2; ++x ) {
+            for( int y=0; y<ax[1].nBins+2; ++y ) {
+                for( int z=0; z<ax[2].nBins+2; ++z ) {
+                    if( !h3.GetBinContent( x, y, z ) && !( withErrors && h3.GetBinError( x, y, z ) ) ) continue;
+                    int bins[3] = { x, y, z };
+                    for( int i=0; i<3; ++i ) {
+                        ax[i].first = std::min( ax[i].first, bins[i] );
+                        ax[i].last  = std::max( ax[i].last,  bins[i] );
+                    }
+                }
+            }
+        }
+        header_.nValues = uint64_t(ax[0].size())*ax[1].size()*ax[2].size();
+    }
+
+    static void findBins( const ScaleMapAxis& axis, const float* x, size_t n, int* bins ) {
+        // Same as ScaleMapAxis::findBin, but without branches, so the loop can be vectorized
+        const double min = axis.min, max = axis.max;
+        const int nBins = axis.nBins;
+        for( size_t i=0; i<n; ++i ) {
+            double xi = x[i];
+            double t = xi < min ? -1 : ( xi < max ? nBins*(xi-min)/(max-min) : nBins );
+            bins[i] = 1 + int( t );
+        }
+    }
+
+    static void findInterpolationBins( const ScaleMapAxis& axis, double x, int& lo, int& hi, double& weightHi ) {
+        // The two bins whose centers enclose x. Under- and overflow are not interpolated,
+        // and outside of the outermost bin centers the value of the outermost bin is used.
+        weightHi = 0;
+        if( x < axis.min ) { lo = hi = 0; return; }
+        if( !( x < axis.max ) ) { lo = hi = axis.nBins+1; return; }
+        double u = axis.nBins*(x-axis.min)/(axis.max-axis.min) - 0.5;
+        if( u <= 0 ) { lo = hi = 1; return; }
+        if( u >= axis.nBins-1 ) { lo = hi = axis.nBins; return; }
+        lo = 1 + int( u );
+        hi = lo + 1;
+        weightHi = u - int( u );
+    }
+
+    void interpolateScale( double e, double eta, double r, float& scale, float* error ) const {
+        int lo[3], hi[3];
+        double w[3];
+        findInterpolationBins( header_.axes[0], e, lo[0], hi[0], w[0] );
+        findInterpolationBins( header_.axes[1], eta, lo[1], hi[1], w[1] );
+        findInterpolationBins( header_.axes[2], r, lo[2], hi[2], w[2] );
+        double sumw = 0, sumScale = 0, sumError = 0;
+        for( int corner=0; corner<8; ++corner ) {
+            int bin[3];
+            double weight = 1;
+            for( int axis=0; axis<3; ++axis ) {
+                bool upper = corner & (1<<axis);
+                bin[axis] = upper ? hi[axis] : lo[axis];
+                weight *= upper ? w[axis] : 1-w[axis];
+            }
+            if( !weight ) continue;
+            float value = getBinContent( bin[0], bin[1], bin[2] );
+            if( !value ) continue;
+            sumw += weight;
+            sumScale += weight*value;
+            sumError += weight*getBinError( bin[0], bin[1], bin[2] );
+        }
+        scale = sumw ? sumScale/sumw : 0;
+        if( error ) *error = sumw ? sumError/sumw : 0;
+    }
+
+    long index( int xbin, int ybin, int zbin ) const {
+        // Returns -1 for bins outside the stored box
+        const auto* ax = header_.axes;
+        if( xbin < ax[0].first || xbin > ax[0].last ||
+            ybin < ax[1].first || ybin > ax[1].last ||
+            zbin < ax[2].first || zbin > ax[2].last ) return -1;
+        return ( long(xbin-ax[0].first)*ax[1].size() + ybin-ax[1].first )*ax[2].size() + zbin-ax[2].first;
+    }
+
+    ScaleMapHeader header_;
+    std::vector<float> owned_;
+    void* mapped_ = 0;
+    size_t mappedSize_ = 0;
+    const float* values_ = 0;
+    const float* errors_ = 0;
+};
+
+class ScaleBatch {
+    /* Collects events and applies the scale map to them in batches.
+     * apply( e, eta, r, scale, error ) is called for each event in the order of add.
+     */
+  public:
+    typedef std::function<void(float,float,float,float,float)> Function;
+
+    ScaleBatch( const ScaleMap& map, Function apply, bool withErrors=false, bool interpolate=false, size_t size=4096 ) :
+        map_( map ),
+        apply_( apply ),
+        withErrors_( withErrors ),
+        interpolate_( interpolate ),
+        size_( size )
+    {
+        for( auto vec : { &e_, &eta_, &r_ } ) vec->reserve( size_ );
+        scales_.resize( size_ );
+        errors_.resize( size_ );
+    }
+
+    ~ScaleBatch() { flush(); }
+
+    void add( float e, float eta, float r ) {
+        e_.push_back( e );
+        eta_.push_back( eta );
+        r_.push_back( r );
+        if( e_.size() == size_ ) flush();
+    }
+
+    void flush() {
+        map_.getScales( e_.data(), eta_.data(), r_.data(), e_.size(), scales_.data(),
+            withErrors_ ? errors_.data() : 0, interpolate_ );
+        for( size_t i=0; i<e_.size(); ++i ) {
+            apply_( e_[i], eta_[i], r_[i], scales_[i], withErrors_ ? errors_[i] : 0 );
+        }
+        e_.clear();
+        eta_.clear();
+        r_.clear();
+    }
+
+  private:
+    const ScaleMap& map_;
+    Function apply_;
+    bool withErrors_, interpolate_;
+    size_t size_;
+    std::vector<float> e_, eta_, r_, scales_, errors_;
+};
+
+void writeScaleMap( const TH3F& h3, const std::string& filename, bool withErrors=false ) {
+    ScaleMap( h3, withErrors ).write( filename );
+}
+
+#endif
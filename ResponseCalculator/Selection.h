@@ -0,0 +1,81 @@
+#ifndef SELECTION_H
+#define SELECTION_H
+
+#include<cstdlib>
+#include<functional>
+#include<initializer_list>
+#include<iostream>
+#include<string>
+#include<vector>
+
+// ROOT
+#include<TInterpreter.h>
+
+/* Cuts are C++ predicates on the events of the event loop. They are evaluated by the reader for each
+ * entry, before the event is passed on, so no selected copy of the tree is needed.
+ * The events provide genE(), genEta() and response(). An empty cut selects all events.
+ */
+template <class EVENT>
+using Cut = std::function<bool(const EVENT&)>;
+
+template <class EVENT>
+bool passes( const Cut<EVENT>& cut, const EVENT& event ) {
+    return !cut || cut( event );
+}
+
+template <class EVENT>
+Cut<EVENT> responseAbove( float minR ) {
+    return [=]( const EVENT& event ) { return event.response() > minR; };
+}
+
+template <class EVENT>
+Cut<EVENT> responseAtLeast( float minR ) {
+    return [=]( const EVENT& event ) { return event.response() >= minR; };
+}
+
+template <class EVENT>
+Cut<EVENT> etaAbove( float minEta ) {
+    return [=]( const EVENT& event ) { return event.genEta() > minEta; };
+}
+
+template <class EVENT>
+Cut<EVENT> etaBetween( float minEta, float maxEta ) {
+    return [=]( const EVENT& event ) { return event.genEta() > minEta && event.genEta() < maxEta; };
+}
+
+template <class EVENT>
+Cut<EVENT> allOf( std::initializer_list<Cut<EVENT>> list ) {
+    std::vector<Cut<EVENT>> cuts( list );
+    return [=]( const EVENT& event ) {
+        for( auto& cut : cuts ) {
+            if( !passes( cut, event ) ) return false;
+        }
+        return true;
+    };
+}
+
+template <class EVENT>
+Cut<EVENT> compileCut( const std::string& expression ) {
+    /* String cut in C++ syntax of the variables e, eta and r, e.g. "r > 0.9 && eta > 1.5".
+     * The expression is compiled once by the interpreter into a function, which is called
+     * directly for each event instead of evaluating a formula.
+     */
+    if( expression.empty() ) return Cut<EVENT>();
+    static int nCompiled = 0;
+    std::string name = "responseCalculatorCut" + std::to_string( nCompiled++ );
+    std::string code = "bool " + name + "( double e, double eta, double r ) { return " + expression + "; }";
+    typedef bool (*Function)( double, double, double );
+    Function function = 0;
+    if( gInterpreter->Declare( code.c_str() ) ) {
+        TInterpreter::EErrorCode error = TInterpreter::kNoError;
+        function = (Function)gInterpreter->Calc( ( "(long)&" + name ).c_str(), &error );
+        if( error != TInterpreter::kNoError ) function = 0;
+    }
+    if( !function ) {
+        std::cerr << "ERROR: Could not compile the cut \"" << expression << "\"" << std::endl;
+        exit(1);
+    }
+    return [=]( const EVENT& event ) { return function( event.genE(), event.genEta(), event.response() ); };
+}
+
+#endif
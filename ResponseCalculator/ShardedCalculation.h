@@ -0,0 +1,320 @@
+#ifndef SHARDEDCALCULATION_H
+#define SHARDEDCALCULATION_H
+
+#include<algorithm>
+#include<chrono>
+#include<cstdint>
+#include<cstdio>
+#include<cstdlib>
+#include<deque>
+#include<fstream>
+#include<iostream>
+#include<string>
+#include<vector>
+
+// processes
+#include<csignal>
+#include<dirent.h>
+#include<poll.h>
+#include<sys/wait.h>
+#include<unistd.h>
+
+// ROOT
+#include<TGraphAsymmErrors.h>
+#include<TH3F.h>
+#include<TROOT.h>
+
+// user incuded files
+#include "AdaptiveBinning.h"
+#include "CellScheduler.h"
+#include "Instrumentation.h"
+#include "ResponseCube.h"
+#include "ResultCache.h"
+#include "ScaleCalculation.h"
+
+// The shards of the workers are written to a temporary directory in SHARDDIR
+std::string SHARDDIR = "/tmp";
+// Initial number of shards per worker process, more shards balance better but have more overhead
+const int SHARDSPERPROCESS = 4;
+
+struct Shard {
+    // The eta groups first to last-1, see getEtaGroups
+    int first, last;
+};
+
+struct ShardDone {
+    // Message of a worker to the driver, after the shard is written
+    int worker;
+    Shard shard;
+    double seconds;
+};
+
+bool writeShard( const std::string& filename, const std::vector<CellResult>& results ) {
+    // The results of the groups of the shard, see writeResult. Returns false if the shard could not be written.
+    std::ofstream file( filename.c_str(), std::ios::binary );
+    for( auto& result : results ) writeResult( file, result );
+    if( !file ) {
+        std::cerr << "ERROR: Could not write shard " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool readShard( const std::string& filename, CellResult* results, int nResults ) {
+    // Returns false if the shard could not be read
+    std::ifstream file( filename.c_str(), std::ios::binary );
+    for( int i=0; i<nResults; ++i ) {
+        if( !readResult( file, results[i] ) ) {
+            std::cerr << "ERROR: Could not read shard " << filename << std::endl;
+            return false;
+        }
+    }
+    std::remove( filename.c_str() );
+    return true;
+}
+
+void removeShardDirectory( const std::string& directory ) {
+    // Removes the directory with the shards, which were not read yet
+    DIR* dir = opendir( directory.c_str() );
+    if( dir ) {
+        while( dirent* entry = readdir( dir ) ) {
+            std::string name = entry->d_name;
+            if( name != "." && name != ".." ) std::remove( ( directory+"/"+name ).c_str() );
+        }
+        closedir( dir );
+    }
+    rmdir( directory.c_str() );
+}
+
+std::string getShardName( const std::string& directory, const Shard& shard ) {
+    return directory + "/shard" + std::to_string( shard.first ) + "_" + std::to_string( shard.last );
+}
+
+void runShardWorker( int worker, int commandFd, int doneFd, const ResponseCube& fast, const ResponseCube& full,
+        const std::vector<EtaGroup>& groups, const std::string& directory, unsigned nThreads ) {
+    // Calculates the shards sent by the driver, until it sends an empty shard
+    Shard shard;
+    while( read( commandFd, &shard, sizeof(Shard) ) == sizeof(Shard) && shard.first < shard.last ) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<CellResult> results( shard.last-shard.first );
+        runCells( results.size(), nThreads, [&]( int i ) {
+            results[i] = calculateGroupCached( fast, full, groups[shard.first+i] );
+        } );
+        // The worker is a fork of the driver, and must not run its exit handlers or flush its buffers
+        if( !writeShard( getShardName( directory, shard ), results ) ) _exit( 1 );
+        ShardDone done{ worker, shard, std::chrono::duration<double>( std::chrono::steady_clock::now()-start ).count() };
+        if( write( doneFd, &done, sizeof(ShardDone) ) != sizeof(ShardDone) ) break;
+    }
+}
+
+TH3F calculateResponseSharded( const ResponseCube& fast, const ResponseCube& full, TH3F h3_scale, int nProcesses,
+        unsigned nThreads=0, TH3F* h3_errorDn=0, TH3F* h3_errorUp=0 ) {
+    /* Same as calculateResponse, but the eta groups are calculated by nProcesses worker processes,
+     * which are forked from this process, so they share the input cubes. Each worker has its own
+     * ROOT state, and uses nThreads/nProcesses threads.
+     * The groups are split in contiguous shards of about the same estimated cost, and the driver sends
+     * the most expensive remaining shard to the next idle worker. The estimate is the number of stored
+     * bins, or 1 for groups in the result cache, corrected per E_gen bin by the measured time of the
+     * finished shards. A shard, which is more expensive than the share of one worker of the remaining
+     * work, is split.
+     * The workers write their results to shard files, which are merged in the order of the groups,
+     * so the output is the same as for calculateResponse.
+     */
+    ScopedTimer timer( "calculateResponseSharded" );
+
+    if( fast.isWeighted() || full.isWeighted() ) {
+        std::cerr << "Please provide unweighted histograms" << std::endl;
+        return h3_scale;
+    }
+    auto groups = getEtaGroups( fast, full, MERGEETAENTRIES );
+    int nGroups = groups.size();
+    nProcesses = std::max( 1, std::min( nProcesses, nGroups ) );
+    unsigned threadsPerProcess = std::max( 1u, getNumberOfThreads( nThreads )/nProcesses );
+
+    // The groups in the result cache are only read by the workers
+    if( RESULTCACHEDIR.size() ) openResultCache();
+    std::vector<double> costs( nGroups );
+    int nCached = 0;
+    for( int i=0; i<nGroups; ++i ) {
+        costs[i] = 1;
+        if( RESULTCACHEDIR.size() && hasCachedResult( hashGroup( fast, full, groups[i] ) ) ) {
+            nCached++;
+            continue;
+        }
+        for( int y=groups[i].firstY; y<=groups[i].lastY; ++y ) {
+            costs[i] += fast.column( groups[i].x, y ).nValues + full.column( groups[i].x, y ).nValues;
+        }
+    }
+    // Measured seconds per cost unit of each E_gen bin, relative to the mean
+    std::vector<double> rowFactors( fast.getNbinsX()+2, 1 );
+    double measuredSeconds = 0, measuredCost = 0;
+    auto getCost = [&]( const Shard& shard ) {
+        double cost = 0;
+        for( int i=shard.first; i<shard.last; ++i ) cost += costs[i]*rowFactors[groups[i].x];
+        return cost;
+    };
+
+    double totalCost = 0;
+    for( auto cost : costs ) totalCost += cost;
+    std::deque<Shard> queue;
+    double target = totalCost/( nProcesses*SHARDSPERPROCESS ), sum = 0;
+    int first = 0;
+    for( int i=0; i<nGroups; ++i ) {
+        sum += costs[i];
+        if( sum < target && i < nGroups-1 ) continue;
+        queue.push_back( Shard{ first, i+1 } );
+        first = i+1;
+        sum = 0;
+    }
+
+    std::vector<char> directory( SHARDDIR.begin(), SHARDDIR.end() );
+    for( char c : std::string( "/responseShardsXXXXXX" ) ) directory.push_back( c );
+    directory.push_back( '\0' );
+    if( !mkdtemp( directory.data() ) ) {
+        std::cerr << "ERROR: Could not create a directory in " << SHARDDIR << std::endl;
+        exit(1);
+    }
+    std::string directoryName = directory.data();
+
+    // The workers inherit the state of this process, and must not inherit unwritten output
+    ROOT::EnableThreadSafety();
+    std::cout.flush();
+    std::cerr.flush();
+    fflush( 0 );
+
+    // A worker, which died, closes its pipe. Writing to it has to return an error instead of killing the driver.
+    auto oldSigpipe = signal( SIGPIPE, SIG_IGN );
+
+    std::vector<int> commandFds( nProcesses );
+    std::vector<pid_t> pids( nProcesses, -1 );
+    std::vector<bool> exited( nProcesses, false );
+    auto fail = [&]( const std::string& message ) {
+        // Stops the workers and removes the shards before exiting
+        std::cerr << "ERROR: " << message << std::endl;
+        for( int worker=0; worker<nProcesses; ++worker ) {
+            if( pids[worker] <= 0 || exited[worker] ) continue;
+            kill( pids[worker], SIGKILL );
+            waitpid( pids[worker], 0, 0 );
+        }
+        removeShardDirectory( directoryName );
+        exit(1);
+    };
+
+    int doneFds[2];
+    if( pipe( doneFds ) != 0 ) fail( "Could not create a pipe" );
+    for( int worker=0; worker<nProcesses; ++worker ) {
+        int fds[2];
+        if( pipe( fds ) != 0 ) fail( "Could not create a pipe" );
+        pids[worker] = fork();
+        if( pids[worker] < 0 ) fail( "Could not start worker process" );
+        if( pids[worker] == 0 ) {
+            close( fds[1] );
+            close( doneFds[0] );
+            for( int other=0; other<worker; ++other ) close( commandFds[other] );
+            runShardWorker( worker, fds[0], doneFds[1], fast, full, groups, directoryName, threadsPerProcess );
+            // The worker must not run the exit handlers of the driver, e.g. the instrumentation report
+            _exit( 0 );
+        }
+        close( fds[0] );
+        commandFds[worker] = fds[1];
+    }
+    close( doneFds[1] );
+
+    auto dispatch = [&]( int worker ) {
+        // Sends the most expensive remaining shard to the worker, or an empty shard to stop it.
+        // Returns if the worker got a shard.
+        Shard shard{ 0, 0 };
+        if( queue.size() ) {
+            std::stable_sort( queue.begin(), queue.end(), [&]( const Shard& a, const Shard& b ) { return getCost( a ) > getCost( b ); } );
+            shard = queue.front();
+            queue.pop_front();
+            double remaining = getCost( shard );
+            for( auto& other : queue ) remaining += getCost( other );
+            if( shard.last-shard.first > 1 && getCost( shard ) > remaining/nProcesses ) {
+                // Split at half of the estimated cost
+                double half = getCost( shard )/2, cost = 0;
+                int split = shard.first;
+                while( split < shard.last-1 && cost < half ) {
+                    cost += costs[split]*rowFactors[groups[split].x];
+                    ++split;
+                }
+                split = std::max( split, shard.first+1 );
+                queue.push_front( Shard{ split, shard.last } );
+                shard.last = split;
+                addCount( "shardsSplit", 1 );
+            }
+        }
+        if( write( commandFds[worker], &shard, sizeof(Shard) ) != sizeof(Shard) ) {
+            fail( "Could not send a shard to worker " + std::to_string( worker ) );
+        }
+        return shard.first < shard.last;
+    };
+
+    auto reap = [&]( int worker, int options ) {
+        // Checks if the worker exited, which is an error unless it was stopped by the driver
+        int status = 0;
+        if( exited[worker] || waitpid( pids[worker], &status, options ) != pids[worker] ) return;
+        exited[worker] = true;
+        if( !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 ) {
+            fail( "Worker process " + std::to_string( worker ) + " failed" );
+        }
+    };
+
+    std::vector<CellResult> results( nGroups );
+    int nRunning = 0, nShards = 0;
+    for( int worker=0; worker<nProcesses; ++worker ) nRunning += dispatch( worker );
+    while( nRunning ) {
+        // The other workers keep the pipe open, so a failed worker is detected by polling
+        pollfd pending{ doneFds[0], POLLIN, 0 };
+        if( poll( &pending, 1, 1000 ) == 0 ) {
+            for( int worker=0; worker<nProcesses; ++worker ) reap( worker, WNOHANG );
+            continue;
+        }
+        ShardDone done;
+        if( read( doneFds[0], &done, sizeof(ShardDone) ) != sizeof(ShardDone) ) fail( "A worker process failed" );
+        if( !readShard( getShardName( directoryName, done.shard ), &results[done.shard.first], done.shard.last-done.shard.first ) ) {
+            fail( "A shard of worker " + std::to_string( done.worker ) + " is incomplete" );
+        }
+        nShards++;
+
+        // Correct the cost estimate of the E_gen bins of the shard by its measured time
+        double cost = 0;
+        for( int i=done.shard.first; i<done.shard.last; ++i ) cost += costs[i];
+        measuredSeconds += done.seconds;
+        measuredCost += cost;
+        double factor = ( done.seconds/cost )/( measuredSeconds/measuredCost );
+        for( int i=done.shard.first; i<done.shard.last; ++i ) rowFactors[groups[i].x] = factor;
+
+        if( !dispatch( done.worker ) ) nRunning--;
+    }
+
+    for( int worker=0; worker<nProcesses; ++worker ) {
+        close( commandFds[worker] );
+        reap( worker, 0 );
+    }
+    close( doneFds[0] );
+    rmdir( directoryName.c_str() );
+    signal( SIGPIPE, oldSigpipe );
+
+    int nFilled = 0;
+    for( const auto& result : results ) nFilled += result.filled;
+    addCount( "cellsProcessed", nFilled );
+    addCount( "cellsSkippedEmpty", results.size()-nFilled );
+    addCount( "shards", nShards );
+    if( RESULTCACHEDIR.size() ) addCount( "cellsCached", nCached );
+
+    for( int i=0; i<nGroups; ++i ) {
+        fillGroup( groups[i], results[i], h3_scale, h3_errorDn, h3_errorUp );
+    }
+    return h3_scale;
+}
+
+TH3F calculateResponseSharded( const TH3F& h3_fast, const TH3F& h3_full, int nProcesses, unsigned nThreads=0,
+        TH3F* h3_errorDn=0, TH3F* h3_errorUp=0 ) {
+    auto h3_scale = bookScale( h3_fast, h3_errorDn, h3_errorUp );
+    ResponseCube fast( h3_fast );
+    ResponseCube full( h3_full );
+    return calculateResponseSharded( fast, full, h3_scale, nProcesses, nThreads, h3_errorDn, h3_errorUp );
+}
+
+#endif
@@ -0,0 +1,461 @@
+#ifndef UNBINNEDSCALE_H
+#define UNBINNEDSCALE_H
+
+#include<algorithm>
+#include<cmath>
+#include<cstdint>
+#include<cstdio>
+#include<limits>
+#include<memory>
+#include<mutex>
+#include<string>
+#include<utility>
+#include<vector>
+
+// ROOT
+#include<TChain.h>
+#include<TH3F.h>
+#include<TProfile.h>
+#include<TROOT.h>
+#include<TVirtualPad.h>
+
+// user incuded files
+#include "CellSamples.h"
+#include "CellScheduler.h"
+#include "CounterRandom.h"
+#include "EventLoop.h"
+#include "ExternalSort.h"
+#include "Instrumentation.h"
+#include "QuantileSketch.h"
+#include "ResponseCube.h"
+#include "ScaleMap.h"
+
+float MINR = 0.3;
+// If > 0, the response distributions are summarized by t-digests with this compression instead of
+// keeping all events in memory. The memory per E_gen, eta_gen bin does not depend on the number of events.
+int SKETCHCOMPRESSION = 0;
+// Number of events, which each chunk buffers before they are added to the t-digests of their bins
+const size_t SKETCHBATCHSIZE = 65536;
+// Number of locks of the t-digests, each protects every SKETCHLOCKS-th bin
+const int SKETCHLOCKS = 256;
+// In the closure, the scale of each event is smeared by a Gaussian of this many times its uncertainty
+float SMEARINGWIDTH = 5;
+unsigned CLOSURESEED = 1;
+
+
+template <class COLUMNS>
+TH3F closure3d( const COLUMNS& columns, const TH3F& scales3d, bool interpolate=false, unsigned nThreads=0,
+    Cut<ResponseEvent> cut=responseAtLeast<ResponseEvent>( MINR ) ) {
+  /* Applies the scale to each event passing the cut, smeared by a Gaussian of SMEARINGWIDTH times its uncertainty.
+   * The events are cached in ResponseColumns, or read again by ResponseStream.
+   * The chunks of the events are processed on nThreads threads. Each fills its own ResponseCube, which
+   * only stores the populated bins. They are added in order, and converted to the histogram once.
+   * The random number of an event only depends on CLOSURESEED and its entry number,
+   * so the result is the same for any number of threads.
+   */
+  ScopedTimer timer( "closure3d" );
+  // The scale carries the uncertainties, which the closure does not need
+  auto closure = *((TH3F*)scales3d.Clone());
+  closure.Reset();
+  closure.Sumw2( false );
+
+  // The scales and uncertainties are looked up in batches
+  ScaleMap scaleMap( scales3d, true );
+  const size_t batchSize = 4096;
+  struct Batch {
+    std::vector<float> e, eta, r, scales, errors;
+    std::vector<uint64_t> entries;
+    std::vector<double> gauss;
+  };
+
+  int nChunks = columns.getNChunks();
+  std::vector<Batch> batches( nChunks );
+
+  std::vector<ResponseCube> partials( nChunks, ResponseCube( *closure.GetXaxis(), *closure.GetYaxis(), *closure.GetZaxis() ) );
+  std::vector<long long> nScaled( nChunks, 0 );
+
+  auto flush = [&]( int chunk ) {
+    auto& batch = batches[chunk];
+    size_t n = batch.e.size();
+    batch.scales.resize( n );
+    batch.errors.resize( n );
+    batch.gauss.resize( n );
+    scaleMap.getScales( batch.e.data(), batch.eta.data(), batch.r.data(), n, batch.scales.data(), batch.errors.data(), interpolate );
+    gaussians( CLOSURESEED, batch.entries.data(), n, batch.gauss.data() );
+    for( size_t i=0; i<n; i++ ) {
+      auto sRand = batch.scales[i] + SMEARINGWIDTH*batch.errors[i]*batch.gauss[i];
+      partials[chunk].fill( batch.e[i], batch.eta[i], batch.r[i]*sRand );
+    }
+    nScaled[chunk] += n;
+    for( auto vec : { &batch.e, &batch.eta, &batch.r } ) vec->clear();
+    batch.entries.clear();
+  };
+
+  columns.forEach( nThreads, [&]( int chunk, long long entry, const ResponseEvent& event ) {
+    if( !passes( cut, event ) ) return;
+    auto& batch = batches[chunk];
+    batch.e.push_back( event.e );
+    batch.eta.push_back( event.eta );
+    batch.r.push_back( event.r );
+    batch.entries.push_back( entry );
+    if( batch.e.size() == batchSize ) flush( chunk );
+  } );
+  // The events left in the batches of the chunks
+  runCells( nChunks, nThreads, flush );
+
+  for( int chunk=1; chunk<nChunks; chunk++ ) partials[0].add( partials[chunk] );
+  if( nChunks ) partials[0].addTo( closure );
+  long long nEvents = 0;
+  for( auto n : nScaled ) nEvents += n;
+  addCount( "eventsScaled", nEvents );
+
+  return closure;
+}
+
+TH3F closure3d( TChain& tree, const TH3F& scales3d, bool interpolate=false, unsigned nThreads=0,
+    Cut<ResponseEvent> cut=responseAtLeast<ResponseEvent>( MINR ) ) {
+  // The events are read while the scale is applied, so they are not kept in memory
+  ResponseStream stream( tree, getNumberOfThreads( nThreads ) );
+  return closure3d( stream, scales3d, interpolate, nThreads, cut );
+}
+
+int getCell( const TAxis& xAxis, const TAxis& yAxis, float e, float eta ) {
+  // Index of the E_gen, eta_gen bin, including under- and overflow
+  return xAxis.FindFixBin( e )*( yAxis.GetNbins()+2 ) + yAxis.FindFixBin( eta );
+}
+
+template <class FAST, class FULL>
+void transferQuantiles( FAST& fast, size_t nFast, FULL& full, size_t nFull, TProfile& profile ) {
+  // For each fastsim event, find the fullsim response at the same quantile.
+  // The sorted events are accessed by at( i ), with increasing indices.
+  for( size_t i=0; i<nFast; i++ ) {
+    auto fa = fast.at( i );
+    auto jRel = 1.*i/nFast*nFull;
+    size_t j = (size_t) jRel;
+    size_t jNext = std::min( j+1, nFull-1 );
+    auto fu = full.at( j )*(jRel-j)+full.at( jNext )*(j-jRel+1);
+    profile.Fill( fa, fu/fa );
+  }
+}
+
+struct ArrayAccess {
+  const float* values;
+  float at( size_t i ) const { return values[i]; }
+};
+
+void transferQuantiles( const float* fast, size_t nFast, const float* full, size_t nFull, TProfile& profile ) {
+  ArrayAccess fastAccess{ fast }, fullAccess{ full };
+  transferQuantiles( fastAccess, nFast, fullAccess, nFull, profile );
+}
+
+void transferQuantiles( const SortedRuns& fast, const SortedRuns& full, int cell, TProfile& profile ) {
+  // Same as for the sorted events in memory, but the events are merged from the sorted runs
+  MergedCell fastCell( fast, cell ), fullCell( full, cell );
+  SequentialAccess<MergedCell> fastAccess( fastCell ), fullAccess( fullCell );
+  transferQuantiles( fastAccess, fast.size( cell ), fullAccess, full.size( cell ), profile );
+}
+
+void countCells( const std::vector<std::vector<double>>& contents ) {
+  // Cells without scale had no fastsim or fullsim events
+  long long nFilled = 0;
+  for( auto& content : contents ) nFilled += !content.empty();
+  addCount( "cellsProcessed", nFilled );
+  addCount( "cellsSkippedEmpty", contents.size()-nFilled );
+}
+
+class CellCollector {
+  /* Consumer of the event loop, which partitions the response of the events passing the cut by
+   * E_gen, eta_gen bin. Each chunk collects its own events, which are merged in order, so the result
+   * does not depend on the number of threads used for reading.
+   * If SKETCHCOMPRESSION > 0, each chunk buffers SKETCHBATCHSIZE events, which are then added to one
+   * t-digest per bin, shared by all chunks. The t-digest of a bin is created with its first event.
+   * The order, in which the chunks add their events, can change the t-digests within their accuracy.
+   * If MEMORYBUDGET > 0, the events are written to sorted runs on disk instead of being kept in memory.
+   */
+ public:
+  CellCollector( const TAxis& xAxis, const TAxis& yAxis, int nChunks, Cut<ResponseEvent> cut=responseAtLeast<ResponseEvent>( MINR ) ) :
+    cut_( cut ),
+    xAxis_( xAxis ),
+    yAxis_( yAxis ),
+    nCells_( ( xAxis.GetNbins()+2 )*( yAxis.GetNbins()+2 ) ),
+    cells_( nChunks ),
+    values_( nChunks ),
+    compression_( SKETCHCOMPRESSION )
+  {
+    if( compression_ > 0 ) {
+      sketches_.resize( nCells_ );
+      pending_.resize( nChunks );
+      locks_.reset( new std::mutex[SKETCHLOCKS] );
+    } else if( MEMORYBUDGET > 0 ) {
+      runs_.reset( new SortedRuns( nCells_, nChunks, MEMORYBUDGET ) );
+    }
+  }
+
+  ResponseConsumer consumer() {
+    return [this]( int chunk, const ResponseEvent& event ) {
+      if( !passes( cut_, event ) ) return;
+      int cell = getCell( xAxis_, yAxis_, event.e, event.eta );
+      if( runs_ ) {
+        runs_->add( chunk, cell, event.r );
+      } else if( compression_ <= 0 ) {
+        cells_[chunk].push_back( cell );
+        values_[chunk].push_back( event.r );
+      } else {
+        pending_[chunk].push_back( std::make_pair( cell, event.r ) );
+        if( pending_[chunk].size() >= SKETCHBATCHSIZE ) addPending( chunk );
+      }
+    };
+  }
+
+  bool isSketch() const { return compression_ > 0; }
+  bool isExternal() const { return bool( runs_ ); }
+
+  CellSamples getSamples( unsigned nThreads=0 ) {
+    // Sorted response of each bin, the collected events are released
+    CellSamples samples( nCells_, cells_, values_ );
+    cells_.clear();
+    values_.clear();
+    ScopedTimer timer( "sortSamples" );
+    samples.sort( nThreads );
+    return samples;
+  }
+
+  const SortedRuns& getRuns( unsigned nThreads=0 ) {
+    // The remaining events are written, so all events are in the runs
+    runs_->finish( nThreads );
+    return *runs_;
+  }
+
+  std::vector<TDigest> getSketches( unsigned nThreads=0 ) {
+    // The t-digest of each bin, after the remaining events are added. The bins without events have empty t-digests.
+    ScopedTimer timer( "mergeSketches" );
+    runCells( pending_.size(), nThreads, [&]( int chunk ) { addPending( chunk ); } );
+    std::vector<TDigest> sketches( nCells_, TDigest( compression_ ) );
+    int nAllocated = 0;
+    for( int cell=0; cell<nCells_; ++cell ) {
+      if( !sketches_[cell] ) continue;
+      sketches[cell] = std::move( *sketches_[cell] );
+      sketches_[cell].reset();
+      nAllocated++;
+    }
+    addCount( "sketchesAllocated", nAllocated );
+    return sketches;
+  }
+
+ private:
+  Cut<ResponseEvent> cut_;
+  TAxis xAxis_, yAxis_;
+  int nCells_;
+  std::vector<std::vector<int>> cells_;
+  std::vector<std::vector<float>> values_;
+  int compression_;
+  std::vector<std::unique_ptr<TDigest>> sketches_;
+  std::vector<std::vector<std::pair<int,float>>> pending_;
+  std::unique_ptr<std::mutex[]> locks_;
+  std::unique_ptr<SortedRuns> runs_;
+
+  void addPending( int chunk ) {
+    // Adds the buffered events of the chunk to the t-digests, the events of each bin at once
+    auto& pending = pending_[chunk];
+    std::stable_sort( pending.begin(), pending.end(),
+      []( const std::pair<int,float>& a, const std::pair<int,float>& b ) { return a.first < b.first; } );
+    for( size_t first=0; first<pending.size(); ) {
+      int cell = pending[first].first;
+      std::lock_guard<std::mutex> lock( locks_[cell % SKETCHLOCKS] );
+      if( !sketches_[cell] ) sketches_[cell].reset( new TDigest( compression_ ) );
+      for( ; first<pending.size() && pending[first].first == cell; ++first ) sketches_[cell]->add( pending[first].second );
+    }
+    pending.clear();
+  }
+};
+
+class CubeFiller {
+  /* Consumer of the event loop, which fills the events passing the cut into a copy of the histogram,
+   * same as TTree::Draw( "r:eta:e>>h", cut ). Each chunk fills its own ResponseCube, which only stores
+   * the populated bins. They are added in order, and converted to the histogram once in get().
+   */
+ public:
+  CubeFiller( const TH3F& h, int nChunks, Cut<ResponseEvent> cut=responseAbove<ResponseEvent>( MINR ) ) :
+    cut_( cut ),
+    result_( h ),
+    partials_( nChunks, ResponseCube( *h.GetXaxis(), *h.GetYaxis(), *h.GetZaxis() ) )
+  {
+    result_.Reset();
+  }
+
+  ResponseConsumer consumer() {
+    return [this]( int chunk, const ResponseEvent& event ) {
+      if( passes( cut_, event ) ) partials_[chunk].fill( event.e, event.eta, event.r );
+    };
+  }
+
+  TH3F get() {
+    for( size_t chunk=1; chunk<partials_.size(); ++chunk ) partials_[0].add( partials_[chunk] );
+    if( partials_.size() ) partials_[0].addTo( result_ );
+    partials_.clear();
+    return result_;
+  }
+
+ private:
+  Cut<ResponseEvent> cut_;
+  TH3F result_;
+  std::vector<ResponseCube> partials_;
+};
+
+void transferQuantiles( TDigest& fast, TDigest& full, const TAxis& zAxis, std::vector<double>& contents, std::vector<double>& errors ) {
+  /* Same as transferQuantiles for the sorted events, but the fastsim events of each z-bin are replaced
+   * by nPoints equidistant quantiles in the range of the bin. As for the profile with option "s",
+   * the content is the mean and the error the standard deviation of the ratios full/fast.
+   */
+  const int nPoints = 16;
+  double qLow = 0;
+  for( int i=0; i<zAxis.GetNbins()+2; i++ ) {
+    double upEdge = i <= zAxis.GetNbins() ? zAxis.GetBinUpEdge(i) : std::numeric_limits<double>::infinity();
+    double qUp = fast.cdf( upEdge );
+    double sum = 0, sum2 = 0;
+    int n = 0;
+    for( int k=0; qUp>qLow && k<nPoints; k++ ) {
+      double q = qLow + ( k+0.5 )/nPoints*( qUp-qLow );
+      double fa = fast.quantile( q );
+      if( !fa ) continue;
+      double ratio = full.quantile( q )/fa;
+      sum += ratio;
+      sum2 += ratio*ratio;
+      n++;
+    }
+    double mean = n ? sum/n : 0;
+    contents.push_back( mean );
+    errors.push_back( n ? sqrt( std::max( sum2/n-mean*mean, 0. ) ) : 0 );
+    qLow = qUp;
+  }
+}
+
+TH3F calculateResponseSketch( CellCollector& fast, CellCollector& full, TH3F h, unsigned nThreads=0 ) {
+
+  const TAxis& xAxis = *h.GetXaxis();
+  const TAxis& yAxis = *h.GetYaxis();
+  const TAxis& zAxis = *h.GetZaxis();
+
+  auto fastSketches = fast.getSketches( nThreads );
+  auto fullSketches = full.getSketches( nThreads );
+
+  size_t nCentroids = 0;
+  for( auto& sketch : fastSketches ) nCentroids += sketch.getCentroids().size();
+  for( auto& sketch : fullSketches ) nCentroids += sketch.getCentroids().size();
+  printf( "%zu centroids in %zu bins\n", nCentroids, fastSketches.size() );
+
+  std::vector<std::vector<double>> contents( fastSketches.size() ), errors( fastSketches.size() );
+  {
+    ScopedTimer timer( "transferQuantiles" );
+    runCells( fastSketches.size(), nThreads, [&]( int cell ) {
+      if( !fastSketches[cell].getTotalWeight() || !fullSketches[cell].getTotalWeight() ) return;
+      transferQuantiles( fastSketches[cell], fullSketches[cell], zAxis, contents[cell], errors[cell] );
+    } );
+  }
+  countCells( contents );
+
+  for( int xbin=0; xbin<xAxis.GetNbins()+2; ++xbin ) {
+    for( int ybin=0; ybin<yAxis.GetNbins()+2; ++ybin ) {
+      int cell = xbin*( yAxis.GetNbins()+2 ) + ybin;
+      for( unsigned i=0; i<contents[cell].size(); i++ ) {
+        h.SetBinContent( xbin, ybin, i, contents[cell][i] );
+        h.SetBinError( xbin, ybin, i, errors[cell][i] );
+      }
+    }
+  }
+
+  return h;
+}
+
+TH3F calculateResponseUnbinned( CellCollector& fast, CellCollector& full, TH3F h, unsigned nThreads=0 ) {
+  // The collectors have to be filled with the same E_gen, eta_gen binning as h
+
+  if( fast.isSketch() ) return calculateResponseSketch( fast, full, h, nThreads );
+
+  const TAxis& xAxis = *h.GetXaxis();
+  const TAxis& yAxis = *h.GetYaxis();
+  const TAxis& zAxis = *h.GetZaxis();
+
+  // The sorted events of each bin are either in memory, or merged from the sorted runs on disk
+  int nCells = ( xAxis.GetNbins()+2 )*( yAxis.GetNbins()+2 );
+  bool external = fast.isExternal();
+  CellSamples fastSamples( nCells ), fullSamples( nCells );
+  if( !external ) {
+    fastSamples = fast.getSamples( nThreads );
+    fullSamples = full.getSamples( nThreads );
+  }
+  const SortedRuns* fastRuns = external ? &fast.getRuns( nThreads ) : 0;
+  const SortedRuns* fullRuns = external ? &full.getRuns( nThreads ) : 0;
+  auto fastSize = [&]( int cell ) { return external ? fastRuns->size( cell ) : fastSamples.size( cell ); };
+  auto fullSize = [&]( int cell ) { return external ? fullRuns->size( cell ) : fullSamples.size( cell ); };
+
+  printf( "fast %zu and full %zu events in %d bins\n", external ? fastRuns->size() : fastSamples.values.size(),
+      external ? fullRuns->size() : fullSamples.values.size(), nCells );
+
+  // Content and error of the scale for each z-bin, including under- and overflow
+  std::vector<std::vector<double>> contents( nCells ), errors( nCells );
+  // The profile of the first bin is kept for drawing
+  int controlCell = getCell( xAxis, yAxis, xAxis.GetBinCenter(1), yAxis.GetBinCenter(1) );
+  std::unique_ptr<TProfile> controlProfile;
+
+  ROOT::EnableThreadSafety();
+  bool addDirectory = TH1::AddDirectoryStatus();
+  TH1::AddDirectory( false );
+
+  {
+    ScopedTimer timer( "transferQuantiles" );
+    runCells( nCells, nThreads, [&]( int cell ) {
+      if( !fastSize( cell ) || !fullSize( cell ) ) return;
+
+      std::unique_ptr<TProfile> profile( new TProfile( ("profile"+std::to_string(cell)).c_str(), "title",
+          zAxis.GetNbins(), zAxis.GetXmin(), zAxis.GetXmax(), "s" ) );
+      if( external ) {
+        transferQuantiles( *fastRuns, *fullRuns, cell, *profile );
+      } else {
+        transferQuantiles( fastSamples.begin( cell ), fastSamples.size( cell ),
+            fullSamples.begin( cell ), fullSamples.size( cell ), *profile );
+      }
+
+      for( int i=0; i<profile->GetNbinsX()+2;i++ ) {
+        contents[cell].push_back( profile->GetBinContent(i) );
+        errors[cell].push_back( profile->GetBinError(i) );
+      }
+      if( cell == controlCell ) controlProfile = std::move( profile );
+    } );
+  }
+  countCells( contents );
+
+  TH1::AddDirectory( addDirectory );
+
+  for( int xbin=0; xbin<xAxis.GetNbins()+2; ++xbin ) {
+    for( int ybin=0; ybin<yAxis.GetNbins()+2; ++ybin ) {
+      int cell = xbin*( yAxis.GetNbins()+2 ) + ybin;
+      for( unsigned i=0; i<contents[cell].size(); i++ ) {
+        h.SetBinContent( xbin, ybin, i, contents[cell][i] );
+        h.SetBinError( xbin, ybin, i, errors[cell][i] );
+      }
+    }
+  }
+
+  if( controlProfile ) {
+    controlProfile->SetMinimum( 0.95 );
+    controlProfile->SetMaximum( 1.05 );
+    controlProfile->Draw();
+    gPad->SaveAs("scaleProfile.pdf");
+  }
+
+  return h;
+
+}
+
+TH3F calculateResponseUnbinned( TChain& fasttree, TChain& fulltree, TH3F h, unsigned nThreads=0,
+    Cut<ResponseEvent> cut=responseAtLeast<ResponseEvent>( MINR ) ) {
+  int nChunks = getNumberOfThreads( nThreads );
+  CellCollector fast( *h.GetXaxis(), *h.GetYaxis(), nChunks, cut );
+  CellCollector full( *h.GetXaxis(), *h.GetYaxis(), nChunks, cut );
+  readOnce( fasttree, nChunks, nChunks, { fast.consumer() } );
+  readOnce( fulltree, nChunks, nChunks, { full.consumer() } );
+  return calculateResponseUnbinned( fast, full, h, nThreads );
+}
+
+#endif
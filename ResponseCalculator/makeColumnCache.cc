@@ -0,0 +1,91 @@
+#include<iostream>
+#include<string>
+#include<vector>
+#include<unistd.h> // provides getopt
+
+// ROOT
+#include<TChain.h>
+
+// user incuded files
+#include "CellScheduler.h"
+#include "ColumnCache.h"
+#include "EventLoop.h"
+#include "Instrumentation.h"
+
+template <class EVENT, class FUNC>
+std::vector<std::vector<float>> readColumns( TChain& chain, int nColumns, unsigned nThreads, FUNC get ) {
+    // get( event, values ) writes the nColumns values of the event. The chunks are concatenated in order.
+    int nChunks = getNumberOfThreads( nThreads );
+    std::vector<std::vector<std::vector<float>>> partials( nChunks, std::vector<std::vector<float>>( nColumns ) );
+    readParallel<EVENT>( chain, nChunks, nChunks, [&]( int chunk, const EVENT& event ) {
+        float values[6];
+        get( event, values );
+        for( int i=0; i<nColumns; ++i ) partials[chunk][i].push_back( values[i] );
+    } );
+
+    std::vector<std::vector<float>> columns( nColumns );
+    for( auto& partial : partials ) {
+        for( int i=0; i<nColumns; ++i ) {
+            columns[i].insert( columns[i].end(), partial[i].begin(), partial[i].end() );
+            std::vector<float>().swap( partial[i] );
+        }
+    }
+    return columns;
+}
+
+int main( int argc, char** argv ) {
+    ScopedTimer timer( "total" );
+
+    unsigned nThreads = 0; // all cores
+    bool simTree = false;
+    bool withHits = false;
+    int opt;
+    while( ( opt = getopt( argc, argv, "j:sHd:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'j': nThreads = std::stoi( optarg ); break;
+            case 's': simTree = true; break;
+            case 'H': withHits = true; break;
+            case 'd': COLUMNCACHEDIR = optarg; break;
+            default: return 1;
+        }
+    }
+    std::vector<std::string> inputs( argv+optind, argv+argc );
+    if( inputs.empty() || ( withHits && !simTree ) ) {
+        std::cerr << "Usage: " << argv[0] << " [-j nThreads] [-s [-H]] [-d directory] input.root [...]" << std::endl;
+        std::cerr << "Writes E_gen, eta_gen and E/E_gen of the responseTree of each input file into a column cache" << std::endl;
+        std::cerr << "input.root.columns, which is read instead of the tree by Closure and unbinnedScaling." << std::endl;
+        std::cerr << "With -s, the SimTree is converted, with -H including the components of the hit vector." << std::endl;
+        std::cerr << "With -d, the caches are written to this directory, e.g. on a local disk." << std::endl;
+        return 1;
+    }
+
+    std::string treename = simTree ? "SimTreeProducer/SimTree" : "ecalScaleFactorCalculator/responseTree";
+    for( auto& input : inputs ) {
+        if( findColumnCache( input, treename ) ) {
+            std::cout << getColumnCacheName( input ) << " is up to date" << std::endl;
+            continue;
+        }
+        TChain chain( treename.c_str() );
+        chain.AddFile( input.c_str() );
+        std::vector<std::vector<float>> columns;
+        if( simTree ) {
+            columns = readColumns<SimEvent>( chain, withHits ? 6 : 3, nThreads, []( const SimEvent& event, float* values ) {
+                values[COLUMNE] = event.genE();
+                values[COLUMNETA] = event.genEta();
+                values[COLUMNR] = event.response();
+                values[COLUMNHITX] = event.hitX;
+                values[COLUMNHITY] = event.hitY;
+                values[COLUMNHITZ] = event.hitZ;
+            } );
+        } else {
+            columns = readColumns<ResponseEvent>( chain, 3, nThreads, []( const ResponseEvent& event, float* values ) {
+                values[COLUMNE] = event.e;
+                values[COLUMNETA] = event.eta;
+                values[COLUMNR] = event.r;
+            } );
+        }
+        writeColumnCache( input, treename, columns );
+        std::cout << "Wrote " << columns[0].size() << " events to " << getColumnCacheName( input ) << std::endl;
+    }
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include<iostream>
 #include<sstream>
 #include<string>
+#include<unistd.h> // provides getopt
 
 // ROOT
 #include<TCanvas.h>
@@ -14,128 +15,99 @@
 #include<TProfile2D.h>
 #include<TROOT.h>
 #include<TChain.h>
+#include<TProfile.h>
 #include<TRandom.h>
 
 // user incuded files
+#include "PlotQueue.h"
+#include "ResponseCube.h"
 #include "Style.h"
+#include "UnbinnedScale.h"
 
 using namespace std;
 
-float MINR = 0.3;
-
-
-TH3F closure3d( TChain& tree, const TH3F& scales3d ) {
-  auto closure = *((TH3F*)scales3d.Clone());
-  closure.Reset();
-
-  float r, eta, e;
-  tree.SetBranchAddress("r",&r);
-  tree.SetBranchAddress("e",&e);
-  tree.SetBranchAddress("eta",&eta);
-  TRandom rand;
-
-  for( int i=0; i<tree.GetEntries(); i++ ) {
-    tree.GetEntry(i);
-    if( r < MINR ) continue;
-    auto bin = scales3d.FindFixBin( e, eta, r );
-    auto scale = scales3d.GetBinContent( bin );
-    auto uncert = scales3d.GetBinError( bin );
-    auto sRand = rand.Gaus( scale, 5*uncert );
-    closure.Fill( e, eta, r*sRand );
-    //closure.Fill( e, eta, r*scale );
-  }
-
-  return closure;
-}
+// Only every PLOTSAMPLING-th E_gen, eta_gen bin is drawn, 0 disables the plots
+int PLOTSAMPLING = 1;
+// Maximal number of pages per pdf, 0 writes all pages into one file
+int PLOTSPERFILE = 0;
 
 void drawClosure( const TH3F& fullh3, const TH3F& fasth3, const TH3F& modih3 ) {
   gStyle->SetOptStat(0);
+  // Copy the inputs once, so each E_gen, eta_gen bin can be accessed without a projection
+  ResponseCube full( fullh3 );
+  ResponseCube fast( fasth3 );
+  ResponseCube modi( modih3 );
+  const TAxis& axis = fast.getZaxis();
+  // The plots are drawn in the background, and own histograms which are not added to a directory
+  PlotQueue plots( "plots/checker.pdf", PLOTSAMPLING, 1000, PLOTSPERFILE );
+  bool addDirectory = TH1::AddDirectoryStatus();
+  TH1::AddDirectory( false );
   for( int xbin=1; xbin< fasth3.GetNbinsX()+1; ++xbin ) { // E_gen
     for( int ybin=1; ybin< fasth3.GetNbinsY()+1; ++ybin ) { // eta_gen
       // Create the 1d histograms
-      auto h1_full = fullh3.ProjectionZ( "full", xbin, xbin, ybin, ybin );
-      auto h1_fast = fasth3.ProjectionZ( "fast", xbin, xbin, ybin, ybin );
-      auto h1_modi = modih3.ProjectionZ( "mod", xbin, xbin, ybin, ybin );
-      h1_full->SetLineColor(1);
-      h1_fast->SetLineColor(2);
-      h1_modi->SetLineColor( kBlue );
-      h1_modi->SetLineWidth(2);
-
-      // scale to unity for drawing
-      h1_full->Scale( 1./h1_full->GetEntries() );
-      h1_fast->Scale( 1./h1_fast->GetEntries() );
-      h1_modi->Scale( 1./h1_modi->GetEntries() );
-
-      // set minimum xaxis
-      //h1_modi->GetXaxis()->SetRangeUser( 0.8, 1.05 );
-
-      // Rebin
-      //h1_modi->Rebin(40);
-      //h1_full->Rebin(40);
-      //h1_fast->Rebin(40);
-
-      h1_modi->Draw("hist");
-      h1_full->Draw("same");
-      h1_fast->Draw("same");
-      gPad->SaveAs( (std::string("plots/checker_")+to_string(xbin)+"vs"+to_string(ybin)+".pdf").c_str() );
+      auto h1_full = columnToHist( full.column( xbin, ybin ), axis, "full" );
+      auto h1_fast = columnToHist( fast.column( xbin, ybin ), axis, "fast" );
+      auto h1_modi = columnToHist( modi.column( xbin, ybin ), axis, "mod" );
+      plots.add( [=, &plots]() mutable {
+        h1_full.SetLineColor(1);
+        h1_fast.SetLineColor(2);
+        h1_modi.SetLineColor( kBlue );
+        h1_modi.SetLineWidth(2);
+
+        // scale to unity for drawing
+        h1_full.Scale( 1./h1_full.GetEntries() );
+        h1_fast.Scale( 1./h1_fast.GetEntries() );
+        h1_modi.Scale( 1./h1_modi.GetEntries() );
+
+        // set minimum xaxis
+        //h1_modi.GetXaxis()->SetRangeUser( 0.8, 1.05 );
+
+        // Rebin
+        //h1_modi.Rebin(40);
+        //h1_full.Rebin(40);
+        //h1_fast.Rebin(40);
+
+        TCanvas can;
+        can.cd();
+        h1_modi.Draw("hist");
+        h1_full.Draw("same");
+        h1_fast.Draw("same");
+        plots.save( can, "checker_"+to_string(xbin)+"vs"+to_string(ybin) );
+      } );
 
     }
   }
-}
-
-std::vector<float> getVectorFromTree( TChain& tree, bool sort=true ) {
-  std::vector<float> vec;
-  vec.reserve( tree.GetEntries() );
-  float r;
-  tree.SetBranchAddress("r",&r);
-  for( int i=0; i<tree.GetEntries(); i++ ) {
-    tree.GetEntry(i);
-    if( r < MINR ) continue;
-    vec.push_back( r );
-  }
-  if( sort ) {
-    std::sort( vec.begin(), vec.end() );
-  }
-
-  return vec;
-}
-
-
-
-TH3F calculateResponseUnbinned( TChain& fasttree, TChain& fulltree, TH3F h ) {
-
-  auto fastvector = getVectorFromTree( fasttree );
-  auto fullvector = getVectorFromTree( fulltree );
-
-  printf( "fast %f to %f\n", fastvector[0], fastvector[fastvector.size()-1] );
-  printf( "full %f to %f\n", fullvector[0], fullvector[fullvector.size()-1] );
-
-  TProfile profile("profile", "title", h.GetZaxis()->GetNbins(), h.GetZaxis()->GetXmin(), h.GetZaxis()->GetXmax(), "s" );
-  for( unsigned i=0; i<fastvector.size(); i++ ) {
-    auto fa = fastvector[i];
-    auto jRel = 1.*i/fastvector.size()*fullvector.size();
-    int j = (int) jRel;
-    auto fu = fullvector[j]*(jRel-j)+fullvector[j+1]*(j-jRel+1);
-    profile.Fill( fa, fu/fa );
-  }
-
-  for( int i=0; i<profile.GetNbinsX()+2;i++ ) {
-    h.SetBinContent( 1, 1, i, profile.GetBinContent(i) );
-    if( i==15) std::cout << profile.GetBinError(i) << std::endl;
-    h.SetBinError( 1, 1, i, profile.GetBinError(i) );
-  }
-
-
-  profile.SetMinimum( 0.95 );
-  profile.SetMaximum( 1.05 );
-  profile.Draw();
-  gPad->SaveAs("scaleProfile.pdf");
-
-  return h;
-
+  TH1::AddDirectory( addDirectory );
 }
 
 int main( int argc, char** argv ) {
+  ScopedTimer timer( "total" );
+
+  // Calculate the scale in each bin of 100 E_gen times 400 eta_gen bins, instead of in one bin for all events.
+  // The histograms of the inputs, the scale and the closure are dense, about 3 GB at this binning.
+  bool fullGrid = false;
+
+  int opt;
+  while( ( opt = getopt( argc, argv, "M:T:k:w:s:g" ) ) != -1 ) {
+    switch( opt ) {
+      case 'g': fullGrid = true; break;
+      case 'M': MEMORYBUDGET = std::stoul( optarg ); break;
+      case 'T': SCRATCHDIR = optarg; break;
+      case 'k': SKETCHCOMPRESSION = std::stoi( optarg ); break;
+      case 'w': SMEARINGWIDTH = std::stof( optarg ); break;
+      case 's': CLOSURESEED = std::stoul( optarg ); break;
+      default:
+        std::cerr << "Usage: " << argv[0] << " [-M budgetMB [-T scratchdir]] [-k compression] [-w width] [-s seed] [-g]" << std::endl;
+        std::cerr << "With -M, at most budgetMB of the events of each input are kept in memory, the others are" << std::endl;
+        std::cerr << "written as sorted runs to scratchdir (default /tmp), and the closure reads the fastsim tree again." << std::endl;
+        std::cerr << "With -k, the response of each bin is summarized by a t-digest with this compression, e.g. 100." << std::endl;
+        std::cerr << "In the closure, the scale is smeared by a Gaussian of width times its uncertainty (default "
+          << SMEARINGWIDTH << "), with random numbers of the given seed (default " << CLOSURESEED << ")." << std::endl;
+        std::cerr << "With -g, the scale is calculated in 100 E_gen times 400 eta_gen bins, instead of one bin for all events." << std::endl;
+        std::cerr << "The histograms of this binning need about 3 GB of memory, independent of the number of threads." << std::endl;
+        return 1;
+    }
+  }
 //  string fastname = "../../CMSSW/CMSSW_7_3_0/src/Analyzer/ECALScaleFactorCalculator/3d_fast.root";
 //  string fullname = "../../CMSSW/CMSSW_7_3_0/src/Analyzer/ECALScaleFactorCalculator/3d_full.root";
   string fastname = "../3d_fast.root";
@@ -147,22 +119,32 @@ int main( int argc, char** argv ) {
   TChain fulltree("ecalScaleFactorCalculator/responseTree");
   fulltree.AddFile( fullname.c_str() );
 
-  //TH3F h3default("responseVsEVsEta", ";E_{gen};#eta_{gen};E/E_{gen}", 100, 5, 1005, 400, 0, 3.2, 2000, 0, 1.05 );
-  TH3F h3default("responseVsEVsEta", ";E_{gen};#eta_{gen};E/E_{gen}", 1, -1, 1e6, 1, -1, 5, 20000, 0.8, 1.01 );
-
-  auto fasth3 = (TH3F*) h3default.Clone("fasth3");
-  auto fullh3 = (TH3F*) h3default.Clone("fullh3");
-
-  fasttree.Draw("r:eta:e>>fasth3", ("r>"+std::to_string(MINR)).c_str() );
-  fulltree.Draw("r:eta:e>>fullh3", ("r>"+std::to_string(MINR)).c_str() );
+  TH3F h3default = fullGrid ?
+    TH3F("responseVsEVsEta", ";E_{gen};#eta_{gen};E/E_{gen}", 100, 5, 1005, 400, 0, 3.2, 2000, 0, 1.05 ) :
+    TH3F("responseVsEVsEta", ";E_{gen};#eta_{gen};E/E_{gen}", 1, -1, 1e6, 1, -1, 5, 20000, 0.8, 1.01 );
+
+  // Each tree is read once: the consumers fill the histogram, collect the response of each bin,
+  // and the fastsim events are cached for the closure, which needs the scale of all events.
+  // With a memory budget, the fastsim events are read again for the closure instead.
+  int nChunks = getNumberOfThreads( 0 );
+  CubeFiller fastFiller( h3default, nChunks ), fullFiller( h3default, nChunks );
+  CellCollector fastCollector( *h3default.GetXaxis(), *h3default.GetYaxis(), nChunks );
+  CellCollector fullCollector( *h3default.GetXaxis(), *h3default.GetYaxis(), nChunks );
+  ResponseColumns fastColumns( nChunks );
+  std::vector<ResponseConsumer> fastConsumers = { fastFiller.consumer(), fastCollector.consumer() };
+  if( MEMORYBUDGET <= 0 ) fastConsumers.push_back( fastColumns.consumer() );
+  readOnce( fasttree, nChunks, nChunks, fastConsumers );
+  readOnce( fulltree, nChunks, nChunks, { fullFiller.consumer(), fullCollector.consumer() } );
+  auto fasth3 = fastFiller.get();
+  auto fullh3 = fullFiller.get();
 
   cout << "Calculate scale" << endl;
-  auto scales3d = calculateResponseUnbinned( fasttree, fulltree, h3default );
+  auto scales3d = calculateResponseUnbinned( fastCollector, fullCollector, h3default );
 
   cout << "Apply scale" << endl;
-  auto closureh3d = closure3d( fasttree, scales3d );
+  auto closureh3d = MEMORYBUDGET > 0 ? closure3d( fasttree, scales3d ) : closure3d( fastColumns, scales3d );
 
-  drawClosure( *fullh3, *fasth3, closureh3d );
+  drawClosure( fullh3, fasth3, closureh3d );
 
 
 }